@@ -1,2 +1,6 @@
 #!/bin/bash
-clang ldengine.c -I/usr/local/include -L/usr/local/lib -F./frameworks -framework SDL2 -o build/LDEngine -O0 -g
\ No newline at end of file
+clang ldengine.c -I/usr/local/include -L/usr/local/lib -F./frameworks -framework SDL2 -o build/LDEngine -O0 -g
+
+# Headless frame benchmark, no SDL needed. Run from a directory with map.txt, camera.txt and the textures:
+#   build/LDEngineBench --path camera.txt
+clang -Xpreprocessor -fopenmp -lomp -DHeadless=1 ldengine.c -lm -o build/LDEngineBench -O2
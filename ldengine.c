@@ -3,7 +3,23 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <math.h>
+#include <string.h>
+
+// Build with -DHeadless=1 to render into an in-memory framebuffer without SDL (frame benchmark)
+#ifndef Headless
+#define Headless 0
+#endif
+
+#if Headless
+#include <time.h>
+#include <unistd.h>
+#else
 #include <SDL2/SDL.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Define windows size
 #define W  640 // width of "game" screen when mini map active
@@ -26,6 +42,15 @@
 #define LightMapping        1
 #define VisibilityTracking  1
 #define SplitScreen         0
+#define TextureTiling       1   // Store texture planes as 32x32 texel tiles instead of flat rows
+#define Mipmapping          1   // Sample textures and lightmaps from the mip level matching the pixel footprint
+#define SurfaceCache        1   // Keep pre-lit texels (texture times lightmap) of visible surfaces in memory
+#define SimdKernels         1   // Light rows of texels with SSE2/AVX2 when the CPU has them (x86 only)
+#define FastReciprocal      0   // Wall columns use the SSE reciprocal estimate plus one Newton step instead of a division
+#define LightmapDensity     16  // Lightmap texels per map unit; each surface rounds its size up to a power of two
+#define SurfaceStreaming    1   // Read the texture cache ahead of the sectors coming into view, within StreamingBudget
+#define LightmapFormat      2   // Lightmap mip chains the renderer samples: 0 = 32-bit texels, 1 = RGB565, 2 = 4x4 blocks of
+                                // two RGB565 colors and 2-bit indices (like BC1, 4 bits a texel)
 
 /********************************************* UTILITY *********************************************/
 /* Math functions get some min, max, vectors cross products, etc.                                  */ 
@@ -52,25 +77,51 @@
     vxs(vxs(x1, y1, x2, y2), (x1) - (x2), vxs(x3, y3, x4, y4), (x3) - (x4)) / vxs((x1) - (x2), (y1) - (y2), (x3) - (x4), (y3) - (y4)), \
     vxs(vxs(x1, y1, x2, y2), (y1) - (y2), vxs(x3, y3, x4, y4), (y3) - (y4)) / vxs((x1) - (x2), (y1) - (y2), (x3) - (x4), (y3) - (y4))})
 
+// HashBytes: Continue a 64-bit FNV-1a hash with `size` more bytes. Start from HashSeed.
+#define HashSeed 14695981039346656037ull
+static unsigned long long HashBytes(unsigned long long hash, const void* data, size_t size)
+{
+    for(const unsigned char* p = data; size-- > 0; ++p)
+    {
+        hash = (hash ^ *p) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
 // Hard-coded limits
 #define MaxVertices 100     // Maximum number of vertices in a map
 #define MaxEdges    100     // Maximum number of edges in a sector
-#define MaxQueue    32      // Maximum number of pending portal renders
-
-static SDL_Surface *surface = NULL;
-
-#if TextureMapping
-typedef int Texture[1024][1024];
-
-struct TextureSet
+#define MaxQueue    32      // Initial size of the portal work list of a strip (it grows as needed)
+#define MaxSectorVisits 64  // Safety net against portal cycles: visits of one sector per strip
+#define StripWidth  32      // Screen columns per independently rendered strip (W = one strip, serial)
+#define SurfaceCacheBytes   (512 << 20)     // Memory budget of the surface cache
+#define MaxSurfaceBlock     (2048 * 2048)   // Largest surface block (in texels) the surface cache will build
+#define StreamingBudget     (64 << 20)      // Texture cache bytes surface streaming keeps resident
+#define StreamLookahead     2               // Portals beyond the view that surface streaming reads ahead through
+
+#if Headless
+// Stand-in for the SDL window surface: W2*H packed 0xRRGGBB pixels in plain memory.
+typedef struct
 {
-    Texture texture;
-    Texture normalmap;
-    Texture lightmap;
-    Texture lightmap_diffuseonly;
-};
+    int w;
+    int h;
+    void *pixels;
+} Framebuffer;
+
+#define LockSurface(s)
+#define UnlockSurface(s)
+#define Delay(ms) usleep((ms) * 1000)
+#else
+typedef SDL_Surface Framebuffer;
+
+#define LockSurface(s)   SDL_LockSurface(s)
+#define UnlockSurface(s) SDL_UnlockSurface(s)
+#define Delay(ms)        SDL_Delay(ms)
 #endif
 
+static Framebuffer *surface = NULL;
+
 struct vec2d
 {
     float x;
@@ -84,6 +135,129 @@ struct vec3d
     float z;
 };
 
+#if TextureMapping
+typedef int Texture[1024 * 1024];
+
+// Texel: Address texel (a,b) of a 1024x1024 plane, both coordinates in 0..1023.
+// With tiling, each 32x32 block of texels is one contiguous 4 KB page, so samples that are close
+// to each other in any direction (floors seen at glancing angles) share cache lines and TLB entries.
+#if TextureTiling
+#define TexelIndex(a, b) ((((a) & 0x3E0) << 10) | (((b) & 0x3E0) << 5) | (((a) & 31) << 5) | ((b) & 31))
+#else
+#define TexelIndex(a, b) (((a) << 10) | (b))
+#endif
+#define Texel(plane, a, b) ((plane)[TexelIndex(a, b)])
+
+// Mip chains: levels 1024x1024 down to 1x1 stored one after another, level 0 first, so a MipTexture
+// can be used anywhere a Texture is expected. Levels smaller than a tile are stored as flat rows.
+#define MipLevels           11
+#define MipOffset(level)    (((1u << 22) - (1u << (22 - 2 * (level)))) / 3)
+#define MipChainTexels      MipOffset(MipLevels)
+
+typedef int MipTexture[MipChainTexels];
+
+#if TextureTiling
+#define TexelIndexLevel(level, a, b) ((level) <= 5 \
+    ? ((((a) >> 5) << (15 - (level))) | (((b) >> 5) << 10) | (((a) & 31) << 5) | ((b) & 31)) \
+    : (((a) << (10 - (level))) | (b)))
+#else
+#define TexelIndexLevel(level, a, b) (((a) << (10 - (level))) | (b))
+#endif
+
+// LevelTexel takes coordinates within the level, MipTexel takes level 0 coordinates (0..1023).
+#define LevelTexel(plane, level, a, b)  ((plane)[MipOffset(level) + TexelIndexLevel(level, a, b)])
+#define MipTexel(plane, level, a, b)    LevelTexel(plane, level, (a) >> (level), (b) >> (level))
+
+// TextureSet: A texture and its normal map. The texture cache stores each distinct one once, and the
+// surfaces point at theirs. Only the baker reads normal maps, so they are mapped just while it runs.
+struct TextureSet
+{
+    const int* texture;                 // MipTexture
+    const int* normalmap;               // Texture, NULL when it is not mapped
+};
+
+// LightmapUnit: What lightmap mip chains are stored in. The renderer reads lightmaps for every pixel, so a
+// smaller format keeps more of them in the caches; the baker works on 32-bit texels and encodes its results.
+#if LightmapFormat == 2
+typedef unsigned long long LightmapUnit;    // 4x4 texels: colors 0 and 1 in bits 0..31, then the 2-bit indices
+#elif LightmapFormat == 1
+typedef unsigned short LightmapUnit;
+#else
+typedef int LightmapUnit;
+#endif
+
+// DecodeRGB565: Packed texel from a 5:6:5 color, with the low bits repeating the high ones so that 31 is 255.
+static inline int DecodeRGB565(unsigned c)
+{
+    unsigned r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    return (int)(((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2));
+}
+
+// DecodeBlockTexel: Texel k (row * 4 + column) of a 4x4 block. Index 0 and 1 pick the colors, 2 and 3 the
+// colors a third and two thirds of the way from color 0 to color 1.
+static inline int DecodeBlockTexel(unsigned long long block, unsigned k)
+{
+    static const unsigned char weights[4] = { 0, 3, 1, 2 };
+    int c0 = DecodeRGB565(block & 0xFFFF), c1 = DecodeRGB565((block >> 16) & 0xFFFF);
+    int w1 = weights[(block >> (32 + 2*k)) & 3], w0 = 3 - w1;
+    int r = (((c0 >> 16) & 0xFF) * w0 + ((c1 >> 16) & 0xFF) * w1) / 3;
+    int g = (((c0 >>  8) & 0xFF) * w0 + ((c1 >>  8) & 0xFF) * w1) / 3;
+    int b = ((c0 & 0xFF) * w0 + (c1 & 0xFF) * w1) / 3;
+    return r * 65536 + g * 256 + b;
+}
+
+// Lightmap: The baked light of one surface (floor, ceiling, upper or lower part of a wall), sized
+// by the surface's extent in the world instead of a fixed 1024x1024. Surface coordinates are map
+// x,z for floors and ceilings, and texture u,v (0..1024 along and down the whole wall) for walls.
+// Only the texels whose center is on the surface are covered; the others get baked light copied
+// from their neighbors, so that samples and mip levels at the surface edges come out right.
+struct lightmap
+{
+    unsigned width, height;             // Level 0 size in texels, powers of two up to 1024
+    unsigned miplevels;
+    unsigned mipoffset[MipLevels + 1];  // Where each level starts in `mips`, in LightmapUnits; the last is the length
+    float origin_u, origin_v;           // Surface coordinates of the corner of texel (0,0)
+    float scale_u, scale_v;             // Texels per surface coordinate unit
+    float texscale;                     // Texture texels per surface coordinate unit
+    struct vec3d corner;                // Map position of the corner of texel (0,0), y up
+    struct vec3d axis_u, axis_v;        // Map distance of one texel along each lightmap axis
+    unsigned covered;                   // Number of covered texels
+    unsigned char* coverage;            // Level 0, 1 for texels on the surface
+    int* texels;                        // Level 0 light, in the texture cache. With LightmapFormat 0 also the mip chain.
+    LightmapUnit* mips;                 // Mip chain in LightmapFormat, in the texture cache
+    int* diffuseonly;                   // Level 0 light after round 1, in the texture cache
+    float* light[2];                    // Level 0 red, green and blue of the radiosity rounds, in the texture cache.
+                                        // Round r bakes light[r % 2] from the light of the last round in the other.
+    unsigned firsttile;                 // Its first bake tile in the bake record
+};
+
+// LightmapTexel: Texel (a,b) of a lightmap mip level; a,b are level 0 coordinates. Lightmaps are small
+// enough to be stored as flat rows, of texels or of 4x4 blocks.
+#define LightmapLevelSize(size, level) max((size) >> (level), 1u)
+static inline int LightmapTexel(const struct lightmap* map, unsigned level, unsigned a, unsigned b)
+{
+    unsigned height = LightmapLevelSize(map->height, level);
+    a >>= level;
+    b >>= level;
+#if LightmapFormat == 2
+    LightmapUnit block = map->mips[map->mipoffset[level] + (a >> 2) * ((height + 3) >> 2) + (b >> 2)];
+    return DecodeBlockTexel(block, (a & 3) * 4 + (b & 3));
+#elif LightmapFormat == 1
+    return DecodeRGB565(map->mips[map->mipoffset[level] + a * height + b]);
+#else
+    return map->mips[map->mipoffset[level] + a * height + b];
+#endif
+}
+
+// LightmapTexelAt: Texel of a lightmap mip level at surface coordinates u,v, clamped to the lightmap.
+static inline int LightmapTexelAt(const struct lightmap* map, unsigned level, float u, float v)
+{
+    int a = clamp((int)((u - map->origin_u) * map->scale_u), 0, (int)map->width - 1);
+    int b = clamp((int)((v - map->origin_v) * map->scale_v), 0, (int)map->height - 1);
+    return LightmapTexel(map, min(level, map->miplevels - 1), a, b);
+}
+#endif
+
 // Sector: Floor and ceiling height; list of edge vertices and neighbors
 static struct sector
 {
@@ -98,13 +272,25 @@ static struct sector
 #if TextureMapping
     struct TextureSet *floortexture;
     struct TextureSet *ceiltexture;
-    struct TextureSet *uppertextures;
-    struct TextureSet *lowertextures;
+    struct TextureSet **uppertextures;
+    struct TextureSet **lowertextures;
+    struct lightmap *floorlightmap;
+    struct lightmap *ceillightmap;
+    struct lightmap *upperlightmaps;
+    struct lightmap *lowerlightmaps;
 #endif
 } *sectors = NULL;
 
 static unsigned NumSectors = 0;
 
+#if TextureMapping
+static struct lightmap *Lightmaps = NULL;   // Lightmaps of all surfaces, in texture cache order
+static unsigned NumLightmaps = 0;
+static struct TextureSet *TextureSets = NULL;       // The distinct textures in the texture cache
+static unsigned NumTextureSets = 0;
+static struct TextureSet **SurfaceTextures = NULL;  // Texture set of each surface, in the order of Lightmaps
+#endif
+
 #if VisibilityTracking
 #define MaxVisibleSectors   256
 
@@ -245,14 +431,120 @@ static void LoadData(void)
     fclose(fp);
 }
 
+/**************************************** COMPILED GEOMETRY ****************************************/
+/* Values derived from the map that the renderer, the baker and the collision code would otherwise */
+/* recompute over and over. CompileGeometry() builds them once after VerifyMap(), as plain arrays: */
+/* one entry per sector, and one per wall for the walls of all sectors back to back (the walls of  */
+/* sector n start at Geometry.firstwall[n]).                                                       */
+/***************************************************************************************************/
+
+static struct geometry
+{
+    // Per sector
+    unsigned *firstwall;
+    struct vec2d *bounding_min;
+    struct vec2d *bounding_max;
+    // Per wall
+    float *normal_x;                    // Unit normal, pointing into the sector
+    float *normal_z;
+    float *line_d;                      // Wall line: normal . point = line_d
+    float *length;
+    float *hole_low;                    // Opening into the neighbor; 9e9 and -9e9 for solid walls
+    float *hole_high;
+} Geometry;
+
+// WallNormal, WallTangent: Unit vectors of wall w in map coordinates (y up).
+#define WallNormal(w)  ((struct vec3d){ Geometry.normal_x[w], 0, Geometry.normal_z[w] })
+#define WallTangent(w) ((struct vec3d){ Geometry.normal_z[w], 0, -Geometry.normal_x[w] })
+
+// WallSide: Signed distance of map point (x,y) from the line of wall w; negative is outside the sector.
+#define WallSide(w, x, y) (Geometry.normal_x[w] * (x) + Geometry.normal_z[w] * (y) - Geometry.line_d[w])
+
+static void FreeGeometry(void)
+{
+    free(Geometry.firstwall);
+    free(Geometry.normal_x);
+    Geometry = (struct geometry) { NULL };
+}
+
+static void CompileGeometry(void)
+{
+    FreeGeometry();
+
+    unsigned NumWalls = 0;
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        NumWalls += sectors[n].nPoints;
+    }
+
+    // One block per group of arrays: sector arrays first, then wall arrays.
+    Geometry.firstwall    = malloc(NumSectors * (sizeof(unsigned) + 2 * sizeof(struct vec2d)));
+    Geometry.bounding_min = (struct vec2d*)(Geometry.firstwall + NumSectors);
+    Geometry.bounding_max = Geometry.bounding_min + NumSectors;
+
+    Geometry.normal_x  = malloc(NumWalls * 6 * sizeof(float));
+    Geometry.normal_z  = Geometry.normal_x + NumWalls;
+    Geometry.line_d    = Geometry.normal_z + NumWalls;
+    Geometry.length    = Geometry.line_d + NumWalls;
+    Geometry.hole_low  = Geometry.length + NumWalls;
+    Geometry.hole_high = Geometry.hole_low + NumWalls;
+
+    for(unsigned n = 0, w = 0; n < NumSectors; ++n)
+    {
+        const struct sector* sect = &sectors[n];
+        const struct vec2d* vert = sect->vertex;
+        struct vec2d bounding_min = { 1e9f, 1e9f };
+        struct vec2d bounding_max = { -1e9f, -1e9f };
+
+        Geometry.firstwall[n] = w;
+
+        for(unsigned s = 0; s < sect->nPoints; ++s, ++w)
+        {
+            bounding_min.x = min(bounding_min.x, vert[s].x);
+            bounding_min.y = min(bounding_min.y, vert[s].y);
+            bounding_max.x = max(bounding_max.x, vert[s].x);
+            bounding_max.y = max(bounding_max.y, vert[s].y);
+
+            float xd = vert[s+1].x - vert[s].x;
+            float zd = vert[s+1].y - vert[s].y;
+            float len = sqrtf(xd*xd + zd*zd);
+
+            Geometry.normal_x[w] = -zd/len;
+            Geometry.normal_z[w] = xd/len;
+            Geometry.line_d[w]   = Geometry.normal_x[w] * vert[s].x + Geometry.normal_z[w] * vert[s].y;
+            Geometry.length[w]   = len;
+
+            int neighbor = sect->neighbors[s];
+            Geometry.hole_low[w]  = neighbor < 0 ? 9e9 : max(sect->floor, sectors[neighbor].floor);
+            Geometry.hole_high[w] = neighbor < 0 ? -9e9 : min(sect->ceil, sectors[neighbor].ceil);
+        }
+
+        Geometry.bounding_min[n] = bounding_min;
+        Geometry.bounding_max[n] = bounding_max;
+    }
+}
+
 static void UnloadData(void)
 {
+    FreeGeometry();
     for(unsigned a = 0; a < NumSectors; ++a)
     {
         free(sectors[a].vertex);
         free(sectors[a].neighbors);
     }
 
+#if TextureMapping
+    for(unsigned m = 0; m < NumLightmaps; ++m)
+    {
+        free(Lightmaps[m].coverage);
+    }
+
+    free(Lightmaps);
+    free(SurfaceTextures);
+    Lightmaps = NULL;
+    SurfaceTextures = NULL;
+    NumLightmaps = 0;
+#endif
     free(sectors);
     sectors = NULL;
     NumSectors = 0;
@@ -294,870 +586,2966 @@ static int Scaler_Next(struct Scaler* i)
 #include <sys/stat.h>
 #include <errno.h>
 
-/*static void LT(char *filename, Texture* name)
-{
-    //Texture* name = NULL; 
-                do { 
-                    FILE* fp = fopen(filename, "rb"); 
-                    if(!fp) perror(filename); else { 
-                        name = malloc (sizeof(Texture));
-                        fseek(fp, 0x11, SEEK_SET); 
-                        for(unsigned y=0; y<1024; ++y)
-                            for(unsigned x=0; x<1024; ++x)
-                            {
-                                int r = fgetc(fp), g = fgetc(fp), b = fgetc(fp); 
-                                (*name)[x][y] = r * 65536 + g*256 + b; 
-                            }
-                            fclose(fp); } 
-                    } while(0);    
-}*/
-
-static int LoadTexture(void)
-{
-    int initialized = 0;
-    int fd = open("ldengine_textures.bin", O_RDWR | O_CREAT, 0644);
-
-    if(lseek(fd, 0, SEEK_END) == 0)
-    {
-InitializeTextures:;
-        // Initialize by loading textures
-        #define LoadTexture(filename, name) \
-            Texture* name = NULL; \
-                do { \
-                    FILE* fp = fopen(filename, "rb"); \
-                    if(!fp) perror(filename); else { \
-                        name = malloc (sizeof(*name));\
-                        fseek(fp, 0x11, SEEK_SET); \
-                        for(unsigned y=0; y<1024; ++y)\
-                            for(unsigned x=0; x<1024; ++x)\
-                            {\
-                                int r = fgetc(fp), g = fgetc(fp), b = fgetc(fp); \
-                                (*name)[x][y] = r * 65536 + g*256 + b; \
-                            }\
-                            fclose(fp); } \
-                    } while(0)  
-
-        //#define LoadTexture(filename, name) Texture* name = NULL; LT(filename, name)
-
-        #define UnloadTexture(name) free (name)   
-
-        Texture dummyLightmap;
-        memset(&dummyLightmap, 0, sizeof(dummyLightmap));
-
-        LoadTexture("wall2.ppm", WallTexture);
-        LoadTexture("wall2_norm.ppm", WallNormal);
-        LoadTexture("wall3.ppm", WallTexture2);
-        LoadTexture("wall3_norm.ppm", WallNormal2);
-        LoadTexture("floor2.ppm", FloorTexture);
-        LoadTexture("floor2_norm.ppm", FloorNormal);
-        LoadTexture("ceil2.ppm", CeilTexture);
-        LoadTexture("ceil2_norm.ppm", CeiltNormal);
-
-        #define SafeWrite(fd, buf, amount) do { \
-            const char* source = (const char*)(buf); \
-            long remain = (amount); \
-            while(remain > 0) { \
-                long result = write(fd, source, remain); \
-                if(result >= 0) { remain -= result; source += result; } \
-                else if(errno == EAGAIN || errno == EINTR) continue; \
-                else break; \
-            } \
-            if(remain > 0) perror("write"); \
-        } while(0)
-
-        #define PutTextureSet(txtname, normname) do { \
-            SafeWrite(fd, txtname, sizeof(Texture)); \
-            SafeWrite(fd, normname, sizeof(Texture)); \
-            SafeWrite(fd, &dummyLightmap, sizeof(Texture)); \
-            SafeWrite(fd, &dummyLightmap, sizeof(Texture)); } while(0)
-
-        printf("Initializing textures...");
-        lseek(fd, 0, SEEK_SET);
-
-        for(unsigned n = 0; n<NumSectors; ++n)
-        {
-            for(int s=printf("%d/%d", n+1, NumSectors); s--;)
-            {
-                putchar('\b');
-            }
-
-            fflush(stdout);
+/****************************************** PPM TEXTURES *******************************************/
+/* Textures are imported from binary PPM (P6) files of any size, which are mapped into memory      */
+/* rather than read through stdio. Each row of pixels is converted to packed texels at once, with  */
+/* SSSE3 byte shuffles when the CPU has them, and scaled to the 1024x1024 planes by nearest texel  */
+/* when it is some other size.                                                                     */
+/***************************************************************************************************/
 
-            PutTextureSet(FloorTexture, FloorNormal);
-            PutTextureSet(CeilTexture, CeiltNormal);
+typedef void (*PackRowKernel)(int* out, const unsigned char* rgb, unsigned n);
 
-            for(unsigned w=0; w<sectors[n].nPoints; ++w)
-            {
-                PutTextureSet(WallTexture, WallNormal);
-            }
+static void PackRGBRow_Scalar(int* out, const unsigned char* rgb, unsigned n)
+{
+    for(unsigned i = 0; i < n; ++i)
+    {
+        out[i] = rgb[i*3 + 0] * 65536 + rgb[i*3 + 1] * 256 + rgb[i*3 + 2];
+    }
+}
 
-            for(unsigned w=0; w<sectors[n].nPoints; ++w)
-            {
-                PutTextureSet(WallTexture2, WallNormal2);
-            }
-        }
-        
-        ftruncate(fd, lseek(fd, 0, SEEK_CUR));
-        printf("\n"); fflush(stdout);
-
-        UnloadTexture(WallTexture);
-        UnloadTexture(WallNormal);
-        UnloadTexture(WallTexture2);
-        UnloadTexture(WallNormal2);
-        UnloadTexture(FloorTexture);
-        UnloadTexture(FloorNormal);
-        UnloadTexture(CeilTexture);
-        UnloadTexture(CeiltNormal);
-
-        #undef UnloadTexture
-        #undef LoadTexture
-        initialized = 1;
+#if SimdKernels && (defined(__x86_64__) || defined(__i386__))
+// PackRGBRow_SSSE3: Four pixels per step, each 16-byte load holding the 12 bytes of four of them.
+__attribute__((target("ssse3")))
+static void PackRGBRow_SSSE3(int* out, const unsigned char* rgb, unsigned n)
+{
+    const __m128i order = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    unsigned i = 0;
+    for(; i + 6 <= n; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(rgb + i*3));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_shuffle_epi8(pixels, order));
     }
 
-    off_t filesize = lseek(fd, 0 ,SEEK_END);
-    char* texturedata = mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(!texturedata) perror("mmap");
+    PackRGBRow_Scalar(out + i, rgb + i*3, n - i);
+}
+#endif
 
-    printf("Loading textures\n");
-    off_t pos = 0;
-    for(unsigned n = 0; n<NumSectors; ++n)
-    {
-        sectors[n].floortexture = (void*)(texturedata + pos); pos += sizeof(struct TextureSet);
-        sectors[n].ceiltexture = (void*)(texturedata + pos); pos += sizeof(struct TextureSet);
+static PackRowKernel PackRGBRow = PackRGBRow_Scalar;
 
-        unsigned w = sectors[n].nPoints;
-        sectors[n].uppertextures = (void*)(texturedata + pos); pos+=sizeof(struct TextureSet) * w;
-        sectors[n].lowertextures = (void*)(texturedata + pos); pos+=sizeof(struct TextureSet) * w;
+// PPMToken: Skip the white space and comments in a PPM header and read the number after them. Returns -1 if
+// there is none.
+static long PPMToken(const unsigned char* data, size_t size, size_t* pos)
+{
+    for(; *pos < size; ++*pos)
+    {
+        if(data[*pos] == '#')
+            while(*pos < size && data[*pos] != '\n') ++*pos;
+        else if(data[*pos] != ' ' && data[*pos] != '\t' && data[*pos] != '\r' && data[*pos] != '\n')
+            break;
     }
 
-    printf("done, %llu bytes mmapped out of %llu\n", (unsigned long long)pos, (unsigned long long) filesize);
-
-    if(pos != filesize)
+    long value = -1;
+    for(; *pos < size && data[*pos] >= '0' && data[*pos] <= '9' && value < 1000000; ++*pos)
     {
-        printf(" -- Wrong filesize! Let's try that again.\n");
-        munmap(texturedata, filesize);
-        goto InitializeTextures;
+        value = max(value, 0) * 10 + (data[*pos] - '0');
     }
 
-    return initialized;
+    return value;
 }
 
-#if LightMapping
-#define vlen(x,y,z) sqrtf((x)*(x) + (y) * (y) + (z) * (z))
-#define vlen2(x0,y0,z0,x1,y1,z1) vlen((x1)-(x0), (y1)-(y0), (z1)-(z0))
-#define vdot3(x0,y0,z0,x1,y1,z1) ((x0)*(x1) + (y0)*(y1) + (z0)*(z1))
-#define vxs3(x0,y0,z0,x1,y1,z1) (struct vec3d){ vxs(y0,z0,y1,z1), vxs(z0,x0,z1,x1), vxs(x0,y0,x1,y1) }
-
-struct Intersection
+// LoadPPM: A texture plane from a binary PPM file, with room for its mip chain. NULL if it cannot be read.
+static MipTexture* LoadPPM(const char* filename)
 {
-    struct vec3d where;                 // Map coordinates where the hit happened, x,z = map, y = height
-    struct TextureSet* surface;         // Information about the surface that was hit
-    struct vec3d normal;                // Perturbet surface normal
-    int sample;                         // RGB sample from surface texture and lightmap
-    int sectorno;                       
-};
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(filename);
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
 
-static int ClampWithDesaturation(int r, int g, int b)
-{
-    int luma = r * 299 + g * 587 + b * 114;
-    if(luma > 255000)
+    size_t size = st.st_size;
+    const unsigned char* data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(data == MAP_FAILED)
     {
-        r = g = b = 255;
+        perror(filename);
+        return NULL;
     }
-    else if(luma <= 0)
+
+    // "P6", width, height, largest value, and a single white space character before the pixels
+    size_t pos = 2;
+    long width = -1, height = -1, maxval = -1;
+    if(size > 2 && data[0] == 'P' && data[1] == '6')
     {
-        r=g=b=0;
+        width = PPMToken(data, size, &pos);
+        height = PPMToken(data, size, &pos);
+        maxval = PPMToken(data, size, &pos);
+        pos += 1;
     }
-    else
+
+    unsigned depth = maxval > 255 ? 2 : 1;
+    if(width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535 || pos > size || (size - pos) / (3 * depth) / width < (size_t)height)
     {
-        double sat = 1000;
-        if(r > 255)
-        {
-            sat = min(sat,(luma-255e3) / (luma-r));
-        }
-        else if(r < 0)
-        {
-            sat = min(sat, luma/(double)(luma-r));
-        }
+        fprintf(stderr, "%s: Not a binary PPM file, or cut short\n", filename);
+        munmap((void*)data, size);
+        return NULL;
+    }
 
-        if(g > 255)
-        {
-            sat = min(sat,(luma-255e3) / (luma-g));
-        }
-        else if(g < 0)
+    MipTexture* texture = malloc(sizeof(*texture));
+    const unsigned char* pixels = data + pos;
+    int row[1024];
+    for(unsigned y = 0; y < 1024; ++y)
+    {
+        const unsigned char* line = pixels + (size_t)(y * height / 1024) * width * 3 * depth;
+        if(width == 1024 && maxval == 255)
+            PackRGBRow(row, line, 1024);
+        else
         {
-            sat = min(sat, luma/(double)(luma-g));
+            for(unsigned x = 0; x < 1024; ++x)
+            {
+                const unsigned char* p = line + (size_t)(x * width / 1024) * 3 * depth;
+                int c[3];
+                for(unsigned k = 0; k < 3; ++k)
+                {
+                    unsigned v = depth == 2 ? p[k*2] * 256 + p[k*2 + 1] : p[k];
+                    c[k] = (v * 255 + maxval / 2) / maxval;
+                }
+                row[x] = c[0] * 65536 + c[1] * 256 + c[2];
+            }
         }
 
-        if(b > 255)
-        {
-            sat = min(sat,(luma-255e3) / (luma-b));
-        }
-        else if(b < 0)
+        // The first coordinate of a plane goes across the picture.
+        for(unsigned x = 0; x < 1024; ++x)
         {
-            sat = min(sat, luma/(double)(luma-b));
+            Texel(*texture, x, y) = row[x];
         }
+    }
 
-        if(sat != 1.0)
+    munmap((void*)data, size);
+    return texture;
+}
+
+// GenerateMipmaps: Fill levels 1.. of a mip chain by averaging 2x2 texels of the level above.
+static void GenerateMipmaps(int* plane)
+{
+    for(unsigned level = 1; level < MipLevels; ++level)
+    {
+        unsigned size = 1024 >> level;
+        for(unsigned a = 0; a < size; ++a)
         {
-            r = (r - luma) * sat/1e3 + luma; 
-            r = clamp(r, 0, 255);
-           
-            g = (g - luma) * sat/1e3 + luma; 
-            g = clamp(g, 0, 255);
-           
-            b = (b - luma) * sat/1e3 + luma; 
-            b = clamp(b, 0, 255);
+            for(unsigned b = 0; b < size; ++b)
+            {
+                int c0 = LevelTexel(plane, level-1, a*2,   b*2);
+                int c1 = LevelTexel(plane, level-1, a*2+1, b*2);
+                int c2 = LevelTexel(plane, level-1, a*2,   b*2+1);
+                int c3 = LevelTexel(plane, level-1, a*2+1, b*2+1);
+                int r = (((c0 >> 16) & 0xFF) + ((c1 >> 16) & 0xFF) + ((c2 >> 16) & 0xFF) + ((c3 >> 16) & 0xFF) + 2) / 4;
+                int g = (((c0 >>  8) & 0xFF) + ((c1 >>  8) & 0xFF) + ((c2 >>  8) & 0xFF) + ((c3 >>  8) & 0xFF) + 2) / 4;
+                int b_ = ((c0 & 0xFF) + (c1 & 0xFF) + (c2 & 0xFF) + (c3 & 0xFF) + 2) / 4;
+                LevelTexel(plane, level, a, b) = r * 65536 + g * 256 + b_;
+            }
         }
     }
-
-    return r * 65536 + g * 256 + b;
 }
 
-static int ApplyLight(int texture, int light)
+// MipLevel: Pick the mip level for a footprint of this many level 0 texels per pixel.
+static unsigned MipLevel(float footprint)
 {
-    int tr = (texture >> 16) & 0xFF;
-    int tg = (texture >>  8) & 0xFF;
-    int tb = (texture >>  0) & 0xFF;
-    int lr = ((light >> 16)  & 0xFF);
-    int lg = ((light >>  8)  & 0xFF);
-    int lb = ((light >>  0)  & 0xFF);
-    int r = tr * lr * 2 / 255;
-    int g = tg * lg * 2 / 255;
-    int b = tb * lb * 2 / 255;
-
-#if 1
-    return ClampWithDesaturation(r,g,b);
+#if Mipmapping
+    return footprint < 2.f ? 0 : min(ilogbf(footprint), MipLevels - 1);
 #else
-    return clamp(tr*lr / 255,0,255) * 65536
-         + clamp(tg*lg / 255, 0, 255) * 256
-         + clamp(tb*lb / 255, 0, 255);
+    (void)footprint;
+    return 0;
 #endif
 }
 
-static void PutColor(int* target, struct vec3d color)
+// LightmapSize: Texels along a surface `extent` map units long, a power of two up to 1024.
+static unsigned LightmapSize(float extent)
 {
-    *target = ClampWithDesaturation(color.x, color.y, color.z);
+    unsigned size = 1;
+    while(size < 1024 && size < extent * LightmapDensity)
+    {
+        size *= 2;
+    }
+
+    return size;
 }
 
-static void AddColor(int* target, struct vec3d color)
+// InitLightmap: Set the size of a lightmap and lay out its mip chain.
+static void InitLightmap(struct lightmap* map, unsigned width, unsigned height)
 {
-    int r = ((*target >> 16) &0xFF) + color.x;
-    int g = ((*target >>  8) &0xFF) + color.y;
-    int b = ((*target >>  0) &0xFF) + color.z;
+    unsigned level = 0, units = 0;
+    map->width = width;
+    map->height = height;
+    map->coverage = calloc(width * height, 1);
+    do
+    {
+        unsigned lwidth = LightmapLevelSize(width, level), lheight = LightmapLevelSize(height, level);
+        map->mipoffset[level] = units;
+#if LightmapFormat == 2
+        units += ((lwidth + 3) >> 2) * ((lheight + 3) >> 2);
+#else
+        units += lwidth * lheight;
+#endif
+    } while(max(width, height) >> level++ > 1);
 
-    *target = ClampWithDesaturation(r,g,b);
+    map->miplevels = level;
+    map->mipoffset[level] = units;
 }
 
-static struct vec3d PerturbNormal(struct vec3d normal, struct vec3d tangent, struct vec3d bitangent, int normal_sample)
+// LightmapBytes: Size of a lightmap in the texture cache: its level 0, its mip chain (the same thing with
+// LightmapFormat 0) and its diffuse-only level 0.
+static size_t LightmapBytes(const struct lightmap* map)
 {
-    struct vec3d perturb = 
-    { 
-        ((normal_sample >> 16) & 0xFF) / 127.5f - 1.f,  
-        ((normal_sample >>  8) & 0xFF) / 127.5f - 1.f,  
-        ((normal_sample >>  0) & 0xFF) / 127.5f - 1.f   
-    };
-
-    return (struct vec3d) 
-    {
-        normal.x * perturb.z + bitangent.x * perturb.y + tangent.x * perturb.x,
-        normal.y * perturb.z + bitangent.y * perturb.y + tangent.y * perturb.x,
-        normal.z * perturb.z + bitangent.z * perturb.y + tangent.z * perturb.x
-    };  
+    size_t texels = map->width * map->height;
+#if LightmapFormat == 0
+    return sizeof(int) * (map->mipoffset[map->miplevels] + texels);
+#else
+    // Whole 8 bytes, so that the next lightmap stays aligned for its blocks.
+    return sizeof(int) * 2 * texels + (sizeof(LightmapUnit) * map->mipoffset[map->miplevels] + 7) / 8 * 8;
+#endif
 }
 
-static void GetSectorBoundingBox(int sectorno, struct vec2d* bounding_min, struct vec2d* bounding_max)
+// InitPlaneLightmap: Floor or ceiling of sector n at the given height. It covers the bounding box.
+static void InitPlaneLightmap(struct lightmap* map, unsigned n, float height)
 {
-    const struct sector* sect = &sectors[sectorno];
-    for(int s = 0; s < sect->nPoints; ++s)
+    const struct sector* sect = &sectors[n];
+    struct vec2d bounding_min = Geometry.bounding_min[n];
+    struct vec2d extent = { max(Geometry.bounding_max[n].x - bounding_min.x, 1e-3f),
+                            max(Geometry.bounding_max[n].y - bounding_min.y, 1e-3f) };
+    InitLightmap(map, LightmapSize(extent.x), LightmapSize(extent.y));
+
+    map->origin_u = bounding_min.x;
+    map->origin_v = bounding_min.y;
+    map->scale_u  = map->width / extent.x;
+    map->scale_v  = map->height / extent.y;
+    map->texscale = 256;
+    map->corner   = (struct vec3d) { bounding_min.x, height, bounding_min.y };
+    map->axis_u   = (struct vec3d) { 1 / map->scale_u, 0, 0 };
+    map->axis_v   = (struct vec3d) { 0, 0, 1 / map->scale_v };
+
+    // Covered: the texel center is inside the sector (even-odd rule, sectors may be concave).
+    for(unsigned a = 0; a < map->width; ++a)
     {
-        bounding_min->x = min(bounding_min->x, sect->vertex[s].x);
-        bounding_min->y = min(bounding_min->y, sect->vertex[s].y);
-        bounding_max->x = max(bounding_max->x, sect->vertex[s].x);
-        bounding_max->y = max(bounding_max->y, sect->vertex[s].y);
+        for(unsigned b = 0; b < map->height; ++b)
+        {
+            float x = map->corner.x + (a + 0.5f) * map->axis_u.x;
+            float y = map->corner.z + (b + 0.5f) * map->axis_v.z;
+            int inside = 0;
+            for(unsigned s = 0; s < sect->nPoints; ++s)
+            {
+                struct vec2d v0 = sect->vertex[s], v1 = sect->vertex[s+1];
+                if((v0.y > y) != (v1.y > y) && x < v0.x + (y - v0.y) * (v1.x - v0.x) / (v1.y - v0.y))
+                {
+                    inside = !inside;
+                }
+            }
 
+            map->coverage[a * map->height + b] = inside;
+            map->covered += inside;
+        }
     }
 }
 
-// Return values:
-//  0 = clear path, nothing hit
-//  1 = hit, *result indicates where it hit
-//  2 = a direct path doesn't lead to this sector
-static int IntersectRay(struct vec3d origin, int origin_sectorno, struct vec3d target, int target_sectorno, struct Intersection* result)
+// InitWallLightmap: The part of wall w (edge s of sector n) from height bottom to top. The texture
+// runs from the ceiling to the floor, so the part starts at the texture v of its top.
+static void InitWallLightmap(struct lightmap* map, unsigned n, unsigned s, unsigned w, float bottom, float top)
 {
-    unsigned n_rescan = 0;
-    int prev_sectorno = -1;
-
-rescan:;
-    ++n_rescan;
-
-    struct sector* sect = &sectors[origin_sectorno];
-
-    //Check if this beam hits one of the sector's edges.
-    unsigned u=0, v=0, lu=0, lv=0;
-    struct vec3d tangent, bitangent;
+    const struct sector* sect = &sectors[n];
+    float height = max(top - bottom, 0);
+    InitLightmap(map, LightmapSize(Geometry.length[w]), LightmapSize(height));
+    float vscale = 1024 / (sect->ceil - sect->floor);
+
+    map->origin_u = 0;
+    map->origin_v = (sect->ceil - top) * vscale;
+    map->scale_u  = map->width / 1024.f;
+    map->scale_v  = map->height / max(height * vscale, 1e-3f);
+    map->texscale = 1;
+    map->corner   = (struct vec3d) { sect->vertex[s].x, top, sect->vertex[s].y };
+    map->axis_u   = (struct vec3d) { (sect->vertex[s+1].x - sect->vertex[s].x) / map->width, 0,
+                                     (sect->vertex[s+1].y - sect->vertex[s].y) / map->width };
+    map->axis_v   = (struct vec3d) { 0, -height / map->height, 0 };
+
+    memset(map->coverage, height > 0, map->width * map->height);
+    map->covered = height > 0 ? map->width * map->height : 0;
+}
 
-    for(int s = 0; s < sect->nPoints; ++s)
+// LayoutLightmaps: Size the lightmaps of all surfaces from the map. Returns their total size in the
+// texture cache (LightmapBytes).
+static size_t LayoutLightmaps(void)
+{
+    for(unsigned m = 0; m < NumLightmaps; ++m)
     {
-        float vx1 = sect->vertex[s+0].x;
+        free(Lightmaps[m].coverage);
+    }
+
+    NumLightmaps = 0;
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        NumLightmaps += 2 + 2 * sectors[n].nPoints;
+    }
+
+    Lightmaps = realloc(Lightmaps, NumLightmaps * sizeof(struct lightmap));
+    memset(Lightmaps, 0, NumLightmaps * sizeof(struct lightmap));
+
+    size_t bytes = 0;
+    struct lightmap* map = Lightmaps;
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        struct sector* sect = &sectors[n];
+        sect->floorlightmap  = map++;
+        sect->ceillightmap   = map++;
+        sect->upperlightmaps = map; map += sect->nPoints;
+        sect->lowerlightmaps = map; map += sect->nPoints;
+
+        InitPlaneLightmap(sect->floorlightmap, n, sect->floor);
+        InitPlaneLightmap(sect->ceillightmap, n, sect->ceil);
+        for(unsigned s = 0; s < sect->nPoints; ++s)
+        {
+            // Solid walls are all upper part. Portals leave the hole out of both parts.
+            unsigned w = Geometry.firstwall[n] + s;
+            int solid = sect->neighbors[s] < 0;
+            float upper_bottom = solid ? sect->floor : max(Geometry.hole_high[w], sect->floor);
+            float lower_top    = solid ? sect->floor : min(Geometry.hole_low[w], sect->ceil);
+            InitWallLightmap(&sect->upperlightmaps[s], n, s, w, upper_bottom, sect->ceil);
+            InitWallLightmap(&sect->lowerlightmaps[s], n, s, w, sect->floor, lower_top);
+        }
+    }
+
+    for(unsigned m = 0; m < NumLightmaps; ++m)
+    {
+        bytes += LightmapBytes(&Lightmaps[m]);
+    }
+
+    // Whole 8 bytes, so that the bake record after the lightmaps is aligned.
+    return (bytes + 7) / 8 * 8;
+}
+
+// The bake record follows the lightmaps in the texture cache: what each sector was last baked from, and
+// the journal of the bake in progress, so that an interrupted bake can go on where it stopped.
+struct bakejournal
+{
+    unsigned round;                 // Round being baked; 0 when there is no bake to go on with
+    unsigned first;                 // Round the bake started from
+    unsigned last;                  // Last round it finished; its light is what the lightmaps get
+    double differences;             // Radiosity differences of the surfaces finished in this round so far
+    unsigned long long random;      // State of the bake's random numbers when this round started
+};
+
+// State of each surface in the round being baked
+#define SurfaceWaiting  0
+#define SurfaceBaked    1           // All of its texels are baked, but it is not finished yet
+#define SurfaceFinished 2
+
+static unsigned long long *BakedSectorHashes = NULL;    // What each sector was last baked from
+static struct bakejournal *BakeJournal = NULL;
+static unsigned long long *BakeJournalHashes = NULL;    // What the sectors being baked are baked from
+static unsigned char *BakeJournalSectors = NULL;        // 1 for the sectors being baked
+static unsigned char *BakeJournalSurfaces = NULL;       // State of each lightmap
+
+// The bake record also keeps how much each tile of BakeTileSize x BakeTileSize texels changed in the radiosity
+// round being baked, and which surfaces it gathered its light from, so the next round can skip the tiles
+// that have converged. The tiles of each lightmap are numbered row by row from its firsttile.
+#define BakeTileSize 16
+#define LightmapTileSpan(size) (((size) + BakeTileSize - 1) / BakeTileSize)
+#define LightmapTiles(map) (LightmapTileSpan((map)->width) * LightmapTileSpan((map)->height))
+#define TileSourceBytes ((NumLightmaps + 7) / 8)
+
+static unsigned NumBakeTiles = 0;
+static float *TileChanges = NULL;                       // Sum of the change of the tile's texels in this round
+static unsigned char *TileSources = NULL;               // A bit for each lightmap the tile's rays hit
+static unsigned char *TileSkip = NULL;                  // 1 for the tiles that this round skips
+
+// BakeRecordSize: Size of the bake record. The light planes of the radiosity rounds are in it too,
+// so that a round can go on after an interruption.
+static size_t BakeRecordSize(void)
+{
+    size_t texels = 0;
+    NumBakeTiles = 0;
+    for(unsigned m = 0; m < NumLightmaps; ++m)
+    {
+        texels += Lightmaps[m].width * Lightmaps[m].height;
+        NumBakeTiles += LightmapTiles(&Lightmaps[m]);
+    }
+
+    return sizeof(unsigned long long) * NumSectors * 2 + sizeof(struct bakejournal)
+         + sizeof(float) * 3 * 2 * texels + NumSectors + NumLightmaps
+         + (sizeof(float) + TileSourceBytes + 1) * (size_t)NumBakeTiles;
+}
+
+// MapBakeRecord: Point the bake record and the light planes of the lightmaps into the texture cache.
+static void MapBakeRecord(char* record)
+{
+    BakedSectorHashes = (void*)record;  record += sizeof(*BakedSectorHashes) * NumSectors;
+    BakeJournal = (void*)record;        record += sizeof(*BakeJournal);
+    BakeJournalHashes = (void*)record;  record += sizeof(*BakeJournalHashes) * NumSectors;
+    unsigned tiles = 0;
+    for(unsigned m = 0; m < NumLightmaps; ++m)
+    {
+        for(unsigned plane = 0; plane < 2; ++plane)
+        {
+            Lightmaps[m].light[plane] = (void*)record;
+            record += sizeof(float) * 3 * Lightmaps[m].width * Lightmaps[m].height;
+        }
+        Lightmaps[m].firsttile = tiles;
+        tiles += LightmapTiles(&Lightmaps[m]);
+    }
+
+    TileChanges = (void*)record;        record += sizeof(*TileChanges) * tiles;
+    BakeJournalSectors = (void*)record; record += NumSectors;
+    BakeJournalSurfaces = (void*)record; record += NumLightmaps;
+    TileSources = (void*)record;        record += TileSourceBytes * tiles;
+    TileSkip = (void*)record;
+}
+
+// SyncCache: Write a part of the texture cache to the disk now, so that it survives the machine going down.
+static void SyncCache(const void* data, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    const char* begin = (const char*)data - (size_t)data % page;
+    if(msync((void*)begin, (const char*)data + size - begin, MS_SYNC) != 0)
+        perror("msync");
+}
+
+// The texture cache starts with a header recording the layout of the cache and where each of its parts is.
+// It is padded to a full page, and so is each texture, so that the texture planes stay page aligned in the mapping.
+// Then come the distinct textures and their normal maps, which are left out of the mapping unless the lightmaps
+// are being baked. Those depend only on the texture files. The parts after them depend on the map: the surface
+// table, the lightmaps and the bake record. When the map is laid out differently, only these are written again.
+#define TextureCacheMagic       "LDTXPACK"
+#define TextureCacheVersion     3       // Raise it when the layout of the texture cache changes
+#define TextureCacheHeaderSize  4096
+#define TextureCachePages(bytes) (((bytes) + TextureCacheHeaderSize - 1) / TextureCacheHeaderSize * TextureCacheHeaderSize)
+
+struct TextureCacheHeader
+{
+    char magic[8];
+    unsigned version;       // TextureCacheVersion the cache was written with
+    unsigned tiling;        // TextureTiling setting the planes were stored with
+    unsigned miplevels;     // Length of the texture mip chains
+    unsigned textures;      // Number of distinct texture sets
+    unsigned lightmapdensity;   // LightmapDensity the lightmaps were sized with
+    unsigned lightmapformat;    // LightmapFormat of their mip chains
+    unsigned surfaces;          // Entries in the surface table; 0 until the lightmaps are laid out
+    unsigned reserved;
+    unsigned long long layouthash;      // LightmapLayoutHash() of the map the lightmaps were laid out for
+    unsigned long long normalmaps;      // Where the parts start, in bytes from the start of the cache
+    unsigned long long surfacetable;
+    unsigned long long bakerecord;
+    unsigned long long filesize;        // And where the cache ends
+};
+
+// TextureCacheSurface: Entry of the surface table, one for each lightmap in LayoutLightmaps order.
+struct TextureCacheSurface
+{
+    unsigned long long offset;  // Where its lightmap is, in bytes from the start of the cache
+    unsigned bytes;             // LightmapBytes() of the lightmap
+    unsigned width, height;     // Level 0 size of the lightmap
+    unsigned textureset;        // Which texture set the surface has
+};
+
+// The texture sets, by their id in the texture cache
+#define WallSet     0u
+#define WallSet2    1u
+#define FloorSet    2u
+#define CeilSet     3u
+#define NumSets     4u
+
+// MapLightmaps: Point the lightmaps at their texels in the texture cache, where the surface table says they are.
+// Each one is its level 0 (with LightmapFormat 0, its mip chain), its diffuse-only level 0, and its mip chain.
+static void MapLightmaps(char* data, const struct TextureCacheSurface* table)
+{
+    for(unsigned m = 0; m < NumLightmaps; ++m)
+    {
+        struct lightmap* map = &Lightmaps[m];
+        map->texels = (int*)(data + table[m].offset);
+#if LightmapFormat == 0
+        map->mips = map->texels;
+        map->diffuseonly = map->texels + map->mipoffset[map->miplevels];
+#else
+        map->diffuseonly = map->texels + map->width * map->height;
+        map->mips = (LightmapUnit*)(map->diffuseonly + map->width * map->height);
+#endif
+    }
+}
+
+static int TextureCacheFile = -1;
+static off_t NormalMapOffset = 0;       // Where the normal maps are in the texture cache
+static char* NormalMapData = NULL;      // And where they are mapped, while they are
+
+// MapNormalMaps: Map the normal maps of the texture sets for the baker. Returns 0 if they cannot be mapped.
+static int MapNormalMaps(void)
+{
+    size_t size = sizeof(Texture) * NumTextureSets;
+    NormalMapData = mmap(NULL, size, PROT_READ, MAP_SHARED, TextureCacheFile, NormalMapOffset);
+    if(NormalMapData == MAP_FAILED)
+    {
+        perror("mmap");
+        NormalMapData = NULL;
+        return 0;
+    }
+
+    for(unsigned k = 0; k < NumTextureSets; ++k)
+    {
+        TextureSets[k].normalmap = (const int*)(NormalMapData + sizeof(Texture) * k);
+    }
+
+    return 1;
+}
+
+static void UnmapNormalMaps(void)
+{
+    for(unsigned k = 0; k < NumTextureSets; ++k)
+    {
+        TextureSets[k].normalmap = NULL;
+    }
+
+    if(NormalMapData)
+        munmap(NormalMapData, sizeof(Texture) * NumTextureSets);
+    NormalMapData = NULL;
+}
+
+#define SafeWrite(fd, buf, amount) do { \
+    const char* source = (const char*)(buf); \
+    long remain = (amount); \
+    while(remain > 0) { \
+        long result = write(fd, source, remain); \
+        if(result >= 0) { remain -= result; source += result; } \
+        else if(errno == EAGAIN || errno == EINTR) continue; \
+        else break; \
+    } \
+    if(remain > 0) perror("write"); \
+} while(0)
+
+// LightmapLayoutHash: What the layout of the parts of the texture cache that depend on the map comes from.
+// Changes to the map that keep it only need their sectors baked again, which the bake record takes care of.
+static unsigned long long LightmapLayoutHash(void)
+{
+    unsigned long long hash = HashBytes(HashSeed, &NumSectors, sizeof(NumSectors));
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        hash = HashBytes(hash, &sectors[n].nPoints, sizeof(sectors[n].nPoints));
+    }
+
+    for(unsigned m = 0; m < NumLightmaps; ++m)
+    {
+        hash = HashBytes(hash, &Lightmaps[m].width, sizeof(Lightmaps[m].width));
+        hash = HashBytes(hash, &Lightmaps[m].height, sizeof(Lightmaps[m].height));
+    }
+
+    return hash;
+}
+
+// WriteTextureSets: Start the texture cache over with the textures and normal maps from the texture files.
+// The header page is left blank; WriteSurfaceTable() writes it once the rest is there, so that a cache whose
+// writing was cut short is not taken for a whole one.
+static void WriteTextureSets(int fd, struct TextureCacheHeader* header)
+{
+    // The files do not depend on each other, so they are decoded at once.
+    static const char* const texturefiles[] = { "wall2.ppm", "wall2_norm.ppm", "wall3.ppm", "wall3_norm.ppm",
+                                                "floor2.ppm", "floor2_norm.ppm", "ceil2.ppm", "ceil2_norm.ppm" };
+    MipTexture* loaded[8];
+    #pragma omp parallel for schedule(dynamic)
+    for(unsigned k = 0; k < 8; ++k)
+    {
+        loaded[k] = LoadPPM(texturefiles[k]);
+    }
+    // LoadPPM has said what went wrong; stop before the old cache is cleared.
+    for(unsigned k = 0; k < 8; ++k)
+    {
+        if(!loaded[k])
+        {
+            fprintf(stderr, "%s: Cannot build the texture cache without it\n", texturefiles[k]);
+            for(unsigned j = 0; j < 8; ++j) free(loaded[j]);
+            exit(1);
+        }
+    }
+
+    MipTexture *textures[NumSets] = { loaded[0], loaded[2], loaded[4], loaded[6] };
+    MipTexture *normals[NumSets]  = { loaded[1], loaded[3], loaded[5], loaded[7] };
+
+    for(unsigned k = 0; k < NumSets; ++k)
+    {
+        GenerateMipmaps(*textures[k]);
+    }
+
+    printf("Initializing textures...");
+    ftruncate(fd, 0);
+    lseek(fd, 0, SEEK_SET);
+
+    static const char padding[TextureCacheHeaderSize] = { 0 };
+    SafeWrite(fd, padding, TextureCacheHeaderSize);
+    for(unsigned k = 0; k < NumSets; ++k)
+    {
+        SafeWrite(fd, textures[k], sizeof(MipTexture));
+        SafeWrite(fd, padding, TextureCachePages(sizeof(MipTexture)) - sizeof(MipTexture));
+    }
+
+    off_t normalmaps = lseek(fd, 0, SEEK_CUR);
+    for(unsigned k = 0; k < NumSets; ++k)
+    {
+        SafeWrite(fd, normals[k], sizeof(Texture));
+    }
+    printf("\n"); fflush(stdout);
+
+    for(unsigned k = 0; k < 8; ++k)
+    {
+        free(loaded[k]);
+    }
+
+    // No surface table yet, so the lightmaps get laid out.
+    *header = (struct TextureCacheHeader) { .magic = TextureCacheMagic, .version = TextureCacheVersion, .tiling = TextureTiling,
+                                            .miplevels = MipLevels, .textures = NumSets };
+    header->normalmaps = normalmaps;
+    header->surfacetable = TextureCachePages(lseek(fd, 0, SEEK_CUR));
+}
+
+// WriteSurfaceTable: Lay out the parts of the texture cache that depend on the map after its normal maps, and
+// write the header. The lightmaps start out black, until they are baked. Then the bake record; zeroes match no
+// sector, so all of them get baked, and there is no bake to resume.
+static void WriteSurfaceTable(int fd, struct TextureCacheHeader* header, size_t lightmapbytes, size_t bakerecordbytes)
+{
+    size_t tablebytes = TextureCachePages(sizeof(struct TextureCacheSurface) * NumLightmaps);
+    struct TextureCacheSurface* table = calloc(tablebytes, 1);
+    unsigned long long offset = header->surfacetable + tablebytes;
+
+    // Surfaces in the order of the lightmaps: floor, ceiling, upper and lower parts of the walls of each sector
+    for(unsigned n = 0, m = 0; n < NumSectors; ++n)
+    {
+        unsigned points = sectors[n].nPoints;
+        for(unsigned s = 0; s < 2 + 2 * points; ++s, ++m)
+        {
+            unsigned set = s == 0 ? FloorSet : s == 1 ? CeilSet : s < 2 + points ? WallSet : WallSet2;
+            table[m] = (struct TextureCacheSurface) { .offset = offset, .bytes = LightmapBytes(&Lightmaps[m]),
+                                                      .width = Lightmaps[m].width, .height = Lightmaps[m].height,
+                                                      .textureset = set };
+            offset += table[m].bytes;
+        }
+    }
+
+    header->lightmapdensity = LightmapDensity;
+    header->lightmapformat = LightmapFormat;
+    header->surfaces = NumLightmaps;
+    header->layouthash = LightmapLayoutHash();
+    header->bakerecord = header->surfacetable + tablebytes + lightmapbytes;
+    header->filesize = header->bakerecord + bakerecordbytes;
+
+    // Cutting the file off after the normal maps makes the rest read back as zeroes when it grows again.
+    ftruncate(fd, header->surfacetable);
+    lseek(fd, header->surfacetable, SEEK_SET);
+    SafeWrite(fd, table, tablebytes);
+    ftruncate(fd, header->filesize);
+    free(table);
+
+    lseek(fd, 0, SEEK_SET);
+    SafeWrite(fd, header, sizeof(*header));
+}
+
+// LoadTexture: Map the texture cache, writing whatever parts of it are missing or out of date. Returns 1 when the
+// lightmaps were laid out again and need to be baked.
+static int LoadTexture(void)
+{
+    int initialized = 0;
+    size_t lightmapbytes = LayoutLightmaps(), bakerecordbytes = BakeRecordSize();
+    int fd = open("ldengine_textures.bin", O_RDWR | O_CREAT, 0644);
+    TextureCacheFile = fd;
+
+    // The header alone tells whether the textures in the cache can be used, and then whether the lightmaps can.
+    struct TextureCacheHeader header;
+    off_t filesize = lseek(fd, 0, SEEK_END);
+    if(pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+    || memcmp(header.magic, TextureCacheMagic, sizeof(header.magic)) != 0 || header.version != TextureCacheVersion
+    || header.tiling != TextureTiling || header.miplevels != MipLevels || header.textures == 0 || header.textures > 256
+    || header.surfacetable != TextureCachePages(header.normalmaps + sizeof(Texture) * header.textures)
+    || (off_t)header.surfacetable > filesize)
+    {
+        if(filesize > 0)
+            printf(" -- Texture cache is from a different layout. Rebuilding it.\n");
+        WriteTextureSets(fd, &header);
+    }
+
+    if(header.surfaces != NumLightmaps || header.layouthash != LightmapLayoutHash()
+    || header.lightmapdensity != LightmapDensity || header.lightmapformat != LightmapFormat
+    || header.bakerecord + bakerecordbytes != header.filesize || (off_t)header.filesize != lseek(fd, 0, SEEK_END))
+    {
+        if(header.surfaces > 0)
+            printf(" -- Lightmaps in the texture cache do not match the map. Laying them out again.\n");
+        WriteSurfaceTable(fd, &header, lightmapbytes, bakerecordbytes);
+        initialized = 1;
+    }
+
+    filesize = header.filesize;
+    char* texturedata = mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(!texturedata) perror("mmap");
+
+    printf("Loading textures\n");
+    NumTextureSets = header.textures;
+    TextureSets = realloc(TextureSets, sizeof(struct TextureSet) * NumTextureSets);
+    for(unsigned k = 0; k < NumTextureSets; ++k)
+    {
+        off_t pos = TextureCacheHeaderSize + TextureCachePages(sizeof(MipTexture)) * k;
+        TextureSets[k] = (struct TextureSet) { (const int*)(texturedata + pos), NULL };
+    }
+
+    // Each surface finds its lightmap and texture set in its entry of the surface table.
+    const struct TextureCacheSurface* table = (const void*)(texturedata + header.surfacetable);
+    MapLightmaps(texturedata, table);
+    MapBakeRecord(texturedata + header.bakerecord);
+    NormalMapOffset = header.normalmaps;
+
+    SurfaceTextures = realloc(SurfaceTextures, sizeof(struct TextureSet*) * NumLightmaps);
+    for(unsigned m = 0; m < NumLightmaps; ++m)
+    {
+        SurfaceTextures[m] = &TextureSets[min(table[m].textureset, NumTextureSets - 1)];
+    }
+
+    for(unsigned n = 0, m = 0; n < NumSectors; ++n)
+    {
+        sectors[n].floortexture = SurfaceTextures[m++];
+        sectors[n].ceiltexture = SurfaceTextures[m++];
+        sectors[n].uppertextures = SurfaceTextures + m;     m += sectors[n].nPoints;
+        sectors[n].lowertextures = SurfaceTextures + m;     m += sectors[n].nPoints;
+    }
+
+    // The normal maps stay out of the mapping.
+    size_t normalmapbytes = header.surfacetable - header.normalmaps;
+    munmap(texturedata + header.normalmaps, normalmapbytes);
+    printf("done, %llu bytes mmapped out of %llu, %.1f MB of it lightmaps, %u distinct textures\n",
+           (unsigned long long)(filesize - normalmapbytes), (unsigned long long)filesize, lightmapbytes / 1048576.0,
+           NumTextureSets);
+
+    return initialized;
+}
+
+#if LightMapping
+#define vlen(x,y,z) sqrtf((x)*(x) + (y) * (y) + (z) * (z))
+#define vlen2(x0,y0,z0,x1,y1,z1) vlen((x1)-(x0), (y1)-(y0), (z1)-(z0))
+#define vdot3(x0,y0,z0,x1,y1,z1) ((x0)*(x1) + (y0)*(y1) + (z0)*(z1))
+#define vxs3(x0,y0,z0,x1,y1,z1) (struct vec3d){ vxs(y0,z0,y1,z1), vxs(z0,x0,z1,x1), vxs(x0,y0,x1,y1) }
+
+struct Intersection
+{
+    struct vec3d where;                 // Map coordinates where the hit happened, x,z = map, y = height
+    struct TextureSet* surface;         // Information about the surface that was hit
+    const struct lightmap* lightmap;    // And its light
+    struct vec3d normal;                // Perturbet surface normal
+    struct vec3d sample;                // RGB light reflected by the surface texture
+    int sectorno;                       
+};
+
+// Light plane of the lightmaps that the rays take the light of the surfaces from
+static unsigned RadiosityPlane = 0;
+
+static int ClampWithDesaturation(int r, int g, int b)
+{
+    int luma = r * 299 + g * 587 + b * 114;
+    if(luma > 255000)
+    {
+        r = g = b = 255;
+    }
+    else if(luma <= 0)
+    {
+        r=g=b=0;
+    }
+    else
+    {
+        double sat = 1000;
+        if(r > 255)
+        {
+            sat = min(sat,(luma-255e3) / (luma-r));
+        }
+        else if(r < 0)
+        {
+            sat = min(sat, luma/(double)(luma-r));
+        }
+
+        if(g > 255)
+        {
+            sat = min(sat,(luma-255e3) / (luma-g));
+        }
+        else if(g < 0)
+        {
+            sat = min(sat, luma/(double)(luma-g));
+        }
+
+        if(b > 255)
+        {
+            sat = min(sat,(luma-255e3) / (luma-b));
+        }
+        else if(b < 0)
+        {
+            sat = min(sat, luma/(double)(luma-b));
+        }
+
+        if(sat != 1.0)
+        {
+            r = (r - luma) * sat/1e3 + luma; 
+            r = clamp(r, 0, 255);
+           
+            g = (g - luma) * sat/1e3 + luma; 
+            g = clamp(g, 0, 255);
+           
+            b = (b - luma) * sat/1e3 + luma; 
+            b = clamp(b, 0, 255);
+        }
+    }
+
+    return r * 65536 + g * 256 + b;
+}
+
+static int ApplyLight(int texture, int light)
+{
+    int tr = (texture >> 16) & 0xFF;
+    int tg = (texture >>  8) & 0xFF;
+    int tb = (texture >>  0) & 0xFF;
+    int lr = ((light >> 16)  & 0xFF);
+    int lg = ((light >>  8)  & 0xFF);
+    int lb = ((light >>  0)  & 0xFF);
+    int r = tr * lr * 2 / 255;
+    int g = tg * lg * 2 / 255;
+    int b = tb * lb * 2 / 255;
+
+#if 1
+    return ClampWithDesaturation(r,g,b);
+#else
+    return clamp(tr*lr / 255,0,255) * 65536
+         + clamp(tg*lg / 255, 0, 255) * 256
+         + clamp(tb*lb / 255, 0, 255);
+#endif
+}
+
+static void PutColor(int* target, struct vec3d color)
+{
+    *target = ClampWithDesaturation(color.x, color.y, color.z);
+}
+
+/**************************************** LIGHTING KERNELS *****************************************/
+/* ApplyLightRow lights n texels at once. The SSE2 and AVX2 versions do 4 and 8 pixels per step    */
+/* with a branch-free ClampWithDesaturation and give the same bits as the scalar one: lit channels */
+/* are 0..510, so 2*t*l/255 is exact in single precision and the saturation math is done in the   */
+/* same double precision operations. SelectKernels picks the best one the CPU supports.            */
+/***************************************************************************************************/
+
+typedef void (*LightRowKernel)(int* out, const int* texture, const int* light, unsigned n);
+
+static void ApplyLightRow_Scalar(int* out, const int* texture, const int* light, unsigned n)
+{
+    for(unsigned i = 0; i < n; ++i)
+    {
+        out[i] = ApplyLight(texture[i], light[i]);
+    }
+}
+
+static LightRowKernel ApplyLightRow = ApplyLightRow_Scalar;
+static const char* LightKernelName = "scalar";
+
+#if SimdKernels && (defined(__x86_64__) || defined(__i386__))
+#define SimdSelect_pd(mask, a, b) _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b))
+
+// LightChannel_SSE2: 2*t*l/255 of one channel of four pixels.
+__attribute__((target("sse2")))
+static inline __m128i LightChannel_SSE2(__m128i texture, __m128i light, int shift)
+{
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    __m128 t = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texture, shift), mask));
+    __m128 l = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(light, shift), mask));
+    return _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_add_ps(t, t), l), _mm_set1_ps(255.f)));
+}
+
+// Desaturate_SSE2: One channel's "if(c > 255) ... else if(c < 0) ..." step of ClampWithDesaturation.
+__attribute__((target("sse2")))
+static inline __m128d Desaturate_SSE2(__m128d sat, __m128d luma, __m128d c)
+{
+    __m128d over  = _mm_cmpgt_pd(c, _mm_set1_pd(255));
+    __m128d hit   = _mm_or_pd(over, _mm_cmplt_pd(c, _mm_setzero_pd()));
+    __m128d num   = SimdSelect_pd(over, _mm_sub_pd(luma, _mm_set1_pd(255e3)), luma);
+    // min_pd(a, b) is a < b ? a : b, just like min().
+    return SimdSelect_pd(hit, _mm_min_pd(sat, _mm_div_pd(num, _mm_sub_pd(luma, c))), sat);
+}
+
+__attribute__((target("sse2")))
+static inline __m128d Saturate_SSE2(__m128d sat, __m128d luma, __m128d c)
+{
+    __m128d v = _mm_add_pd(_mm_div_pd(_mm_mul_pd(_mm_sub_pd(c, luma), sat), _mm_set1_pd(1e3)), luma);
+    return _mm_min_pd(_mm_max_pd(v, _mm_setzero_pd()), _mm_set1_pd(255));
+}
+
+// ClampWithDesaturation_SSE2: Two pixels, channels as doubles.
+__attribute__((target("sse2")))
+static inline __m128i ClampWithDesaturation_SSE2(__m128d r, __m128d g, __m128d b)
+{
+    __m128d luma = _mm_add_pd(_mm_add_pd(_mm_mul_pd(r, _mm_set1_pd(299)), _mm_mul_pd(g, _mm_set1_pd(587))),
+                              _mm_mul_pd(b, _mm_set1_pd(114)));
+    __m128d sat = _mm_set1_pd(1000);
+    sat = Desaturate_SSE2(sat, luma, r);
+    sat = Desaturate_SSE2(sat, luma, g);
+    sat = Desaturate_SSE2(sat, luma, b);
+
+    __m128d rgb = _mm_add_pd(_mm_add_pd(_mm_mul_pd(Saturate_SSE2(sat, luma, r), _mm_set1_pd(65536)),
+                                        _mm_mul_pd(Saturate_SSE2(sat, luma, g), _mm_set1_pd(256))),
+                             Saturate_SSE2(sat, luma, b));
+    rgb = SimdSelect_pd(_mm_cmple_pd(luma, _mm_setzero_pd()), _mm_setzero_pd(), rgb);
+    rgb = SimdSelect_pd(_mm_cmpgt_pd(luma, _mm_set1_pd(255000)), _mm_set1_pd(0xFFFFFF), rgb);
+    return _mm_cvttpd_epi32(rgb);
+}
+
+__attribute__((target("sse2")))
+static void ApplyLightRow_SSE2(int* out, const int* texture, const int* light, unsigned n)
+{
+    unsigned i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i t = _mm_loadu_si128((const __m128i*)(texture + i));
+        __m128i l = _mm_loadu_si128((const __m128i*)(light + i));
+        __m128i r = LightChannel_SSE2(t, l, 16);
+        __m128i g = LightChannel_SSE2(t, l, 8);
+        __m128i b = LightChannel_SSE2(t, l, 0);
+
+        // No channel above 255: nothing to desaturate.
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(_mm_or_si128(_mm_or_si128(r, g), b), 8), _mm_setzero_si128())) == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b));
+            continue;
+        }
+
+        __m128i lo = ClampWithDesaturation_SSE2(_mm_cvtepi32_pd(r), _mm_cvtepi32_pd(g), _mm_cvtepi32_pd(b));
+        __m128i hi = ClampWithDesaturation_SSE2(_mm_cvtepi32_pd(_mm_shuffle_epi32(r, 0xEE)),
+                                                _mm_cvtepi32_pd(_mm_shuffle_epi32(g, 0xEE)),
+                                                _mm_cvtepi32_pd(_mm_shuffle_epi32(b, 0xEE)));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi64(lo, hi));
+    }
+
+    ApplyLightRow_Scalar(out + i, texture + i, light + i, n - i);
+}
+
+#define SimdSelect256_pd(mask, a, b) _mm256_blendv_pd(b, a, mask)
+
+__attribute__((target("avx2")))
+static inline __m256i LightChannel_AVX2(__m256i texture, __m256i light, int shift)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256 t = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texture, shift), mask));
+    __m256 l = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(light, shift), mask));
+    return _mm256_cvttps_epi32(_mm256_div_ps(_mm256_mul_ps(_mm256_add_ps(t, t), l), _mm256_set1_ps(255.f)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d Desaturate_AVX2(__m256d sat, __m256d luma, __m256d c)
+{
+    __m256d over  = _mm256_cmp_pd(c, _mm256_set1_pd(255), _CMP_GT_OQ);
+    __m256d hit   = _mm256_or_pd(over, _mm256_cmp_pd(c, _mm256_setzero_pd(), _CMP_LT_OQ));
+    __m256d num   = SimdSelect256_pd(over, _mm256_sub_pd(luma, _mm256_set1_pd(255e3)), luma);
+    return SimdSelect256_pd(hit, _mm256_min_pd(sat, _mm256_div_pd(num, _mm256_sub_pd(luma, c))), sat);
+}
+
+__attribute__((target("avx2")))
+static inline __m256d Saturate_AVX2(__m256d sat, __m256d luma, __m256d c)
+{
+    __m256d v = _mm256_add_pd(_mm256_div_pd(_mm256_mul_pd(_mm256_sub_pd(c, luma), sat), _mm256_set1_pd(1e3)), luma);
+    return _mm256_min_pd(_mm256_max_pd(v, _mm256_setzero_pd()), _mm256_set1_pd(255));
+}
+
+// ClampWithDesaturation_AVX2: Four pixels, channels as doubles.
+__attribute__((target("avx2")))
+static inline __m128i ClampWithDesaturation_AVX2(__m128i r32, __m128i g32, __m128i b32)
+{
+    __m256d r = _mm256_cvtepi32_pd(r32), g = _mm256_cvtepi32_pd(g32), b = _mm256_cvtepi32_pd(b32);
+    __m256d luma = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(r, _mm256_set1_pd(299)), _mm256_mul_pd(g, _mm256_set1_pd(587))),
+                                 _mm256_mul_pd(b, _mm256_set1_pd(114)));
+    __m256d sat = _mm256_set1_pd(1000);
+    sat = Desaturate_AVX2(sat, luma, r);
+    sat = Desaturate_AVX2(sat, luma, g);
+    sat = Desaturate_AVX2(sat, luma, b);
+
+    __m256d rgb = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(Saturate_AVX2(sat, luma, r), _mm256_set1_pd(65536)),
+                                              _mm256_mul_pd(Saturate_AVX2(sat, luma, g), _mm256_set1_pd(256))),
+                                Saturate_AVX2(sat, luma, b));
+    rgb = SimdSelect256_pd(_mm256_cmp_pd(luma, _mm256_setzero_pd(), _CMP_LE_OQ), _mm256_setzero_pd(), rgb);
+    rgb = SimdSelect256_pd(_mm256_cmp_pd(luma, _mm256_set1_pd(255000), _CMP_GT_OQ), _mm256_set1_pd(0xFFFFFF), rgb);
+    return _mm256_cvttpd_epi32(rgb);
+}
+
+__attribute__((target("avx2")))
+static void ApplyLightRow_AVX2(int* out, const int* texture, const int* light, unsigned n)
+{
+    unsigned i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i t = _mm256_loadu_si256((const __m256i*)(texture + i));
+        __m256i l = _mm256_loadu_si256((const __m256i*)(light + i));
+        __m256i r = LightChannel_AVX2(t, l, 16);
+        __m256i g = LightChannel_AVX2(t, l, 8);
+        __m256i b = LightChannel_AVX2(t, l, 0);
+
+        if(_mm256_testz_si256(_mm256_or_si256(_mm256_or_si256(r, g), b), _mm256_set1_epi32(~0xFF)))
+        {
+            _mm256_storeu_si256((__m256i*)(out + i), _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8)), b));
+            continue;
+        }
+
+        __m128i lo = ClampWithDesaturation_AVX2(_mm256_castsi256_si128(r), _mm256_castsi256_si128(g), _mm256_castsi256_si128(b));
+        __m128i hi = ClampWithDesaturation_AVX2(_mm256_extracti128_si256(r, 1), _mm256_extracti128_si256(g, 1),
+                                                _mm256_extracti128_si256(b, 1));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_set_m128i(hi, lo));
+    }
+
+    ApplyLightRow_SSE2(out + i, texture + i, light + i, n - i);
+}
+#endif
+
+// SelectKernels: Pick the lighting kernel for this CPU. `name` forces one ("scalar", "sse2" or "avx2").
+// Returns 0 if the forced kernel is not available.
+static int SelectKernels(const char* name)
+{
+    ApplyLightRow = ApplyLightRow_Scalar;
+    LightKernelName = "scalar";
+    PackRGBRow = PackRGBRow_Scalar;
+#if SimdKernels && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if((!name || strcmp(name, "scalar") != 0) && __builtin_cpu_supports("ssse3"))
+        PackRGBRow = PackRGBRow_SSSE3;
+
+    if((!name || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+    {
+        ApplyLightRow = ApplyLightRow_AVX2;
+        LightKernelName = "avx2";
+    }
+    else if((!name || strcmp(name, "sse2") == 0) && __builtin_cpu_supports("sse2"))
+    {
+        ApplyLightRow = ApplyLightRow_SSE2;
+        LightKernelName = "sse2";
+    }
+#endif
+    return !name || strcmp(name, LightKernelName) == 0;
+}
+
+static struct vec3d PerturbNormal(struct vec3d normal, struct vec3d tangent, struct vec3d bitangent, int normal_sample)
+{
+    struct vec3d perturb = 
+    { 
+        ((normal_sample >> 16) & 0xFF) / 127.5f - 1.f,  
+        ((normal_sample >>  8) & 0xFF) / 127.5f - 1.f,  
+        ((normal_sample >>  0) & 0xFF) / 127.5f - 1.f   
+    };
+
+    return (struct vec3d) 
+    {
+        normal.x * perturb.z + bitangent.x * perturb.y + tangent.x * perturb.x,
+        normal.y * perturb.z + bitangent.y * perturb.y + tangent.y * perturb.x,
+        normal.z * perturb.z + bitangent.z * perturb.y + tangent.z * perturb.x
+    };  
+}
+
+/****************************************** RAY PACKETS ********************************************/
+/* Rays are traced through the sector/portal graph in packets of up to RayPacketSize. The rays of  */
+/* a packet that are in the same sector are tested against each of its edges together, in branch-  */
+/* free loops the compiler vectorizes; only rays that do cross an edge are followed up one by      */
+/* one. Every ray ends up exactly where tracing it on its own would take it.                       */
+/***************************************************************************************************/
+
+#define RayPacketSize 8
+#define RayTraversing -1
+
+struct raypacket
+{
+    unsigned count;
+    int target_sectorno;
+    float ox[RayPacketSize], oy[RayPacketSize], oz[RayPacketSize];    // Where each ray currently starts
+    float tx[RayPacketSize], ty[RayPacketSize], tz[RayPacketSize];    // Where it is going
+    int sectorno[RayPacketSize];                                      // Sector it is currently in
+    int prev_sectorno[RayPacketSize];
+    int result[RayPacketSize];                                        // 0 clear, 1 hit, 2 no direct path, or RayTraversing
+};
+
+// SegmentsCross: IntersectLineSegments() without branches, for the lane loops.
+#define LaneOverlap(a0, a1, b0, b1) ((min(a0, a1) <= max(b0, b1)) & (min(b0, b1) <= max(a0, a1)))
+#define SegmentsCross(x0, y0, x1, y1, x2, y2, x3, y3)                                        \
+    (LaneOverlap(x0, x1, x2, x3) & LaneOverlap(y0, y1, y2, y3)                               \
+    & (abs(PointSide(x2, y2, x0, y0, x1, y1) + PointSide(x3, y3, x0, y0, x1, y1)) != 2)      \
+    & (abs(PointSide(x0, y0, x2, y2, x3, y3) + PointSide(x1, y1, x2, y2, x3, y3)) != 2))
+
+static void AddRay(struct raypacket* packet, struct vec3d origin, int origin_sectorno, struct vec3d target)
+{
+    unsigned i = packet->count++;
+    packet->ox[i] = origin.x;
+    packet->oy[i] = origin.y;
+    packet->oz[i] = origin.z;
+    packet->tx[i] = target.x;
+    packet->ty[i] = target.y;
+    packet->tz[i] = target.z;
+    packet->sectorno[i] = origin_sectorno;
+    packet->prev_sectorno[i] = -1;
+    packet->result[i] = RayTraversing;
+}
+
+// SampleSurface: Texture texel u,v and the light at surface coordinates lu,lv where the ray hit. Like ApplyLight(),
+// but from the RadiosityPlane and without clamping.
+static void SampleSurface(struct Intersection* result, unsigned u, unsigned v, float lu, float lv,
+                          struct vec3d tangent, struct vec3d bitangent)
+{
+    const struct lightmap* map = result->lightmap;
+    int texture_sample = Texel(result->surface->texture, v, u);
+    int normal_sample  = Texel(result->surface->normalmap, v, u);
+    int a = clamp((int)((lu - map->origin_u) * map->scale_u), 0, (int)map->width - 1);
+    int b = clamp((int)((lv - map->origin_v) * map->scale_v), 0, (int)map->height - 1);
+    const float* light = &map->light[RadiosityPlane][(a * map->height + b) * 3];
+    result->sample = (struct vec3d)
+    {
+        ((texture_sample >> 16) & 0xFF) * light[0] * (2 / 255.f),
+        ((texture_sample >>  8) & 0xFF) * light[1] * (2 / 255.f),
+        ((texture_sample >>  0) & 0xFF) * light[2] * (2 / 255.f)
+    };
+    result->normal = PerturbNormal(result->normal, tangent, bitangent, normal_sample);
+}
+
+// RayHitWall: Ray i hit wall s (w in Geometry) of sect at x,y,z.
+static void RayHitWall(const struct raypacket* p, unsigned i, const struct sector* sect, unsigned s, unsigned w,
+                       float x, float y, float z, struct Intersection* result)
+{
+    float vx1 = sect->vertex[s+0].x;
+    float vy1 = sect->vertex[s+0].y;
+    float vx2 = sect->vertex[s+1].x;
+    float vy2 = sect->vertex[s+1].y;
+
+    // Solid walls are all upper part.
+    int lower = sect->neighbors[s] >= 0 && y < Geometry.hole_low[w];
+
+    result->where       = (struct vec3d) { x, y, z};
+    result->surface     = lower ? sect->lowertextures[s] : sect->uppertextures[s];
+    result->lightmap    = lower ? &sect->lowerlightmaps[s] : &sect->upperlightmaps[s];
+    result->sectorno    = p->sectorno[i];
+    result->normal      = (struct vec3d){ -Geometry.normal_x[w], 0, -Geometry.normal_z[w] };
+
+    // Calculate the texture coordinates.
+    float dx = vx2 - vx1;
+    float dy = vy2 - vy1;
+
+    unsigned v = (unsigned)((y - sect->floor) * 1024.0f / (sect->ceil - sect->floor)) % 1024u;
+    unsigned u = (abs(dx) > abs(dy) ? (unsigned)((x-vx1)*1024/dx)
+                                    : (unsigned)((z-vy1)*1024/dy)) % 1024u;
+
+    // Wall lightmaps use the texture coordinates, but with v running down from the ceiling.
+    float lu = abs(dx) > abs(dy) ? (x-vx1)*1024/dx : (z-vy1)*1024/dy;
+    float lv = (sect->ceil - y) * 1024.0f / (sect->ceil - sect->floor);
+    SampleSurface(result, u, v, lu, lv, WallTangent(w), (struct vec3d){ 0, 1, 0 });
+}
+
+// RayHitPlane: Ray i hit the ceiling (ceil = 1) or the floor of sect.
+static void RayHitPlane(const struct raypacket* p, unsigned i, const struct sector* sect, int ceil, struct Intersection* result)
+{
+    struct vec3d tangent;
+    if(ceil)
+    {
+        result->where.y = sect->ceil;
+        result->surface = sect->ceiltexture;
+        result->lightmap = sect->ceillightmap;
+        result->normal  = (struct vec3d){ 0, -1, 0 };
+        tangent         = (struct vec3d){ 1, 0, 0 };
+    }
+    else
+    {
+        result->where.y = sect->floor;
+        result->surface = sect->floortexture;
+        result->lightmap = sect->floorlightmap;
+        result->normal  = (struct vec3d){ 0, 1, 0};
+        tangent         = (struct vec3d){ -1, 0, 0};
+    }
+    struct vec3d bitangent = vxs3(result->normal.x, result->normal.y, result->normal.z, tangent.x, tangent.y, tangent.z);
+    result->sectorno = p->sectorno[i];
+
+    // Determine X & Z coordinates.
+    result->where.x = (result->where.y - p->oy[i]) * (p->tx[i] - p->ox[i]) / (p->ty[i] - p->oy[i]) + p->ox[i];
+    result->where.z = (result->where.y - p->oy[i]) * (p->tz[i] - p->oz[i]) / (p->ty[i] - p->oy[i]) + p->oz[i];
+
+    // Calculate the texture coordinates.
+    unsigned u = ((unsigned)(result->where.x * 256)) % 1024u;
+    unsigned v = ((unsigned)(result->where.z * 256)) % 1024u;
+
+    // Floor and ceiling lightmaps are addressed with map coordinates.
+    SampleSurface(result, u, v, result->where.x, result->where.z, tangent, bitangent);
+}
+
+// TraceSector: Take the rays of the packet that are in sector `sectorno` through it. Each of them
+// either ends (hits a surface, reaches its target) or moves on into a neighboring sector.
+static void TraceSector(struct raypacket* p, int sectorno, struct Intersection* results)
+{
+    const struct sector* sect = &sectors[sectorno];
+    int active[RayPacketSize];
+
+    for(unsigned i = 0; i < RayPacketSize; ++i)
+    {
+        active[i] = i < p->count && p->result[i] == RayTraversing && p->sectorno[i] == sectorno;
+    }
+
+    for(unsigned s = 0; s < sect->nPoints; ++s)
+    {
+        float vx1 = sect->vertex[s+0].x;
         float vy1 = sect->vertex[s+0].y;
         float vx2 = sect->vertex[s+1].x;
         float vy2 = sect->vertex[s+1].y;
 
-        if(!IntersectLineSegments(origin.x, origin.z, target.x, target.z, vx1, vy1, vx2, vy2))
+        // Which rays cross this edge on their way out? A ray running along a portal could otherwise seem to
+        // cross it both ways, and go back and forth between the sectors on its sides forever.
+        int cross[RayPacketSize];
+        int any = 0;
+        for(unsigned i = 0; i < RayPacketSize; ++i)
+        {
+            cross[i] = active[i] & SegmentsCross(p->ox[i], p->oz[i], p->tx[i], p->tz[i], vx1, vy1, vx2, vy2)
+                     & (PointSide(p->tx[i], p->tz[i], vx1, vy1, vx2, vy2) < 0);
+            any |= cross[i];
+        }
+
+        if(!any)
+            continue;
+
+        unsigned w = Geometry.firstwall[sectorno] + s;
+        for(unsigned i = 0; i < RayPacketSize; ++i)
+        {
+            if(!cross[i])
+                continue;
+
+            struct vec3d origin = { p->ox[i], p->oy[i], p->oz[i] };
+            struct vec3d target = { p->tx[i], p->ty[i], p->tz[i] };
+
+            // Determine the X and Z coordinates of the wall hit.
+            struct vec2d hit = Intersect(origin.x, origin.z, target.x, target.z, vx1, vy1, vx2, vy2);
+            float x = hit.x;
+            float z = hit.y;
+
+            // Also determine the Y coordinate
+            float y = origin.y + ((abs(target.x - origin.x) > abs(target.z-origin.z))
+                                    ? ((x - origin.x) * (target.y - origin.y) / (target.x - origin.x))
+                                    : ((z - origin.z) * (target.y - origin.y) / (target.z - origin.z)));
+
+            if(y >= Geometry.hole_low[w] && y <= Geometry.hole_high[w])
+            {
+                // the point fit in between  this hole.
+                p->sectorno[i] = sect->neighbors[s];
+                p->ox[i] = x + (target.x - origin.x)*1e-2;
+                p->oy[i] = y + (target.y - origin.y)*1e-2;
+                p->oz[i] = z + (target.z - origin.z)*1e-2;
+
+                float distance = vlen(target.x - p->ox[i], target.y - p->oy[i], target.z - p->oz[i]);
+
+                // Back into the sector it just came from: keep checking this sector's edges from here.
+                if(p->sectorno[i] == p->prev_sectorno[i])
+                    continue;
+
+                active[i] = 0;
+                if(distance < 1e-3f)
+                {
+                    p->result[i] = p->sectorno[i] == p->target_sectorno ? 0 : 2;
+                    continue;
+                }
+
+                p->prev_sectorno[i] = p->sectorno[i];
+                continue;
+            }
+
+            active[i] = 0;
+            p->result[i] = 1;
+            if(!results)
+                continue;
+
+            // Hit the road jack, D:! hit the ceil, or hit the wall.
+            if(y < sect->floor)
+                RayHitPlane(p, i, sect, 0, &results[i]);
+            else if(y > sect->ceil)
+                RayHitPlane(p, i, sect, 1, &results[i]);
+            else
+                RayHitWall(p, i, sect, s, w, x, y, z, &results[i]);
+        }
+    }
+
+    // Rays that did not leave through an edge end on the ceiling, the floor or at their target.
+    for(unsigned i = 0; i < RayPacketSize; ++i)
+    {
+        if(!active[i])
+            continue;
+
+        if(p->ty[i] > sect->ceil || p->ty[i] < sect->floor)
+        {
+            p->result[i] = 1;
+            if(results)
+                RayHitPlane(p, i, sect, p->ty[i] > sect->ceil, &results[i]);
+        }
+        else
+        {
+            // Is the target in this sector?
+            p->result[i] = p->sectorno[i] == p->target_sectorno ? 0 : 2;
+        }
+    }
+}
+
+// TracePacket: Trace all rays of the packet. results (one per ray) may be NULL for shadow rays,
+// which only need to know whether something is in the way.
+static void TracePacket(struct raypacket* p, struct Intersection* results)
+{
+    for(unsigned i = 0; i < p->count; )
+    {
+        if(p->result[i] == RayTraversing)
+            TraceSector(p, p->sectorno[i], results);
+        else
+            ++i;
+    }
+}
+
+#define narealightcomponents    16
+#define area_light_radius       0.4
+#define nrandomvectors          64
+#define firstround              1
+#define maxrounds               100
+#define fade_distance_diffuse   10.0
+#define fade_distance_radiosity 10.0
+#define radiomul                1.0
+#define irradiance_spacing      8       // Texels between the radiosity samples that are interpolated at first
+#define irradiance_error        4.0     // Largest difference of the samples around the texels interpolated
+#define irradiance_accuracy     0.5     // Largest size of a cell interpolated, relative to the distance of what is around it
+
+// BakeRandom: Random numbers for the bake. The state is kept in the bake journal at the start of each
+// round, so that a resumed round draws the same numbers again.
+#define BakeRandomSeed 1ull
+static unsigned long long BakeRandomState = BakeRandomSeed;
+static unsigned BakeRandom(void)
+{
+    BakeRandomState = BakeRandomState * 6364136223846793005ull + 1442695040888963407ull;
+    return BakeRandomState >> 33;
+}
+
+// The samples of the area lights and of the radiosity rays are Hammersley points in the unit square.
+// Each texel shifts them by its own offset (a Cranley-Patterson rotation), so they stay stratified but
+// neighbouring texels do not share their noise. The offsets go along the R2 sequence over the texels of all
+// lightmaps, starting from a random point each round; they only depend on the texel and the round, not
+// on which thread bakes it.
+static struct vec2d AreaLightPoints[narealightcomponents];
+static struct vec2d HemispherePoints[nrandomvectors];
+static struct vec2d RoundSampleOffset;
+
+// HammersleyPoints: The n points (i + 1/2) / n, with the bits of i mirrored around the binary point.
+static void HammersleyPoints(struct vec2d* points, unsigned n)
+{
+    for(unsigned i = 0; i < n; ++i)
+    {
+        unsigned bits = i;
+        bits = (bits << 16) | (bits >> 16);
+        bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+        bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+        bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+        bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+        points[i] = (struct vec2d) { (i + 0.5f) / n, bits * 2.3283064365386963e-10f };
+    }
+}
+
+// TexelSampleOffset: The rotation of the sample points for texel (a,b) of a lightmap.
+static struct vec2d TexelSampleOffset(const struct lightmap* map, unsigned a, unsigned b)
+{
+    double n = (double)(map->texels - Lightmaps[0].texels) + a * map->height + b;
+    double u = RoundSampleOffset.x + n * 0.7548776662466927, v = RoundSampleOffset.y + n * 0.5698402909980532;
+    return (struct vec2d) { u - floor(u), v - floor(v) };
+}
+
+// Rotate: Shift a sample point by an offset, wrapping around the unit square.
+static inline struct vec2d Rotate(struct vec2d point, struct vec2d offset)
+{
+    float u = point.x + offset.x, v = point.y + offset.y;
+    return (struct vec2d) { u >= 1.f ? u - 1.f : u, v >= 1.f ? v - 1.f : v };
+}
+
+// The lights that can shine on each sector, in SectorLightList[SectorLightStart[n] .. SectorLightStart[n+1]-1].
+// See BuildSectorLights().
+static unsigned* SectorLightList = NULL;
+static unsigned* SectorLightStart = NULL;
+
+// DiffuseLightCalculation: Light falling on the lightmap texel `target` straight from the light sources.
+// `offset` rotates the sample points for this texel.
+static void DiffuseLightCalculation(struct vec3d normal, struct vec3d tangent, struct vec3d bitangent, int normal_sample,
+                                    int* target, struct vec3d point_in_wall, unsigned sectorno, struct vec2d offset)
+{
+    struct vec3d perturbed_normal = PerturbNormal(normal, tangent, bitangent, normal_sample);
+
+    //  A lightsource is represented by a spherical cloud of smaller lightsources around the actual lightsource.
+    // The achieves smooth edges for the shadows. They are spread evenly over the sphere.
+    struct vec3d cloud[narealightcomponents];
+    for(unsigned qa = 0; qa < narealightcomponents; ++qa)
+    {
+        struct vec2d point = Rotate(AreaLightPoints[qa], offset);
+        float z = 1.f - 2.f * point.x, r = sqrtf(max(1.f - z * z, 0.f)), phi = 2 * 3.14159265f * point.y;
+        cloud[qa] = (struct vec3d) { r * cosf(phi) * area_light_radius, r * sinf(phi) * area_light_radius, z * area_light_radius };
+    }
+
+    // For each lightsource, check if ther is an obstacle in between this vertex and the lightsource.
+    // Calculate the ambient light levels from the fact.
+    // This simulates diffuse light.
+    struct vec3d color = {0, 0, 0};
+    for(unsigned k = SectorLightStart[sectorno]; k < SectorLightStart[sectorno + 1]; ++k)
+    {
+        const struct light* light = &lights[SectorLightList[k]];
+        struct vec3d source = 
+        { 
+            point_in_wall.x + normal.x * 1e-5f,
+            point_in_wall.y + normal.y * 1e-5f,
+            point_in_wall.z + normal.z * 1e-5f
+        };
+
+        // The rays to the points of the area light go out in packets; only whether they get through matters.
+        float power[narealightcomponents];
+        int clear[narealightcomponents];
+        unsigned lane[RayPacketSize];
+        struct raypacket packet = { .count = 0, .target_sectorno = light->sector };
+
+        for(unsigned qa = 0; qa < narealightcomponents; ++qa)
+        {
+            struct vec3d target  = { light->where.x + cloud[qa].x, light->where.y + cloud[qa].y, light->where.z + cloud[qa].z };
+            struct vec3d towards = { target.x - source.x, target.y - source.y, target.z - source.z };
+            float len = vlen(towards.x, towards.y, towards.z);
+            float invlen = 1.0f / len;
+            
+            towards.x *= invlen;
+            towards.y *= invlen;
+            towards.z *= invlen;
+
+            float cosine = vdot3(perturbed_normal.x, perturbed_normal.y, perturbed_normal.z, towards.x, towards.y, towards.z);
+            power[qa] = cosine / (1.f + powf(len / fade_distance_diffuse, 2.0f));
+            power[qa] /= (float) narealightcomponents;
+            clear[qa] = 0;
+
+            if(power[qa] > 1e-7f)
+            {
+                lane[packet.count] = qa;
+                AddRay(&packet, source, sectorno, target);
+            }
+
+            if(packet.count == RayPacketSize || (qa == narealightcomponents - 1 && packet.count > 0))
+            {
+                TracePacket(&packet, NULL);
+                for(unsigned i = 0; i < packet.count; ++i)
+                {
+                    clear[lane[i]] = packet.result[i] == 0;
+                }
+                packet.count = 0;
+            }
+        }
+
+        for(unsigned qa = 0; qa < narealightcomponents; ++qa)
+        {
+            if(clear[qa])
+            {
+                color.x += light->light.x * power[qa];
+                color.y += light->light.y * power[qa];
+                color.z += light->light.z * power[qa];
+            }
+        }
+    }
+
+    PutColor(target, color);
+}
+
+// RadiosityCalculation: The light reflected onto a point of a surface by the surfaces around it.
+// `offset` rotates the sample points for this point. The lightmaps it reflects are marked in `sources`,
+// and *nearby is the harmonic mean distance of what the rays hit.
+static struct vec3d RadiosityCalculation(struct vec3d normal, struct vec3d tangent, struct vec3d bitangent, int normal_sample,
+                                         struct vec3d point_in_wall, unsigned sectorno, struct vec2d offset,
+                                         unsigned char* sources, float* nearby)
+{
+    struct vec3d perturbed_normal = PerturbNormal(normal, tangent, bitangent, normal_sample);
+
+    // Shoot rays to each random direction and see what it hits.
+    // Take the last round's light value from that location.
+    struct vec3d source = 
+    {
+        point_in_wall.x + normal.x * 1e-3f,
+        point_in_wall.y + normal.y * 1e-3f,
+        point_in_wall.z + normal.z * 1e-3f
+    };
+
+    float basepower = radiomul / nrandomvectors;
+
+    // The rays go out over the hemisphere above the surface, more of them the closer they are to its normal
+    // (Lambert's cosine law), so each one counts the same.
+    struct vec3d color = { 0, 0, 0 };
+    float inverse_distances = 0;
+    for(unsigned first = 0; first < nrandomvectors; first += RayPacketSize)
+    {
+        struct raypacket packet = { .count = 0, .target_sectorno = -1 };
+        struct Intersection hits[RayPacketSize];
+
+        for(unsigned qq = first; qq < nrandomvectors && qq < first + RayPacketSize; ++qq)
+        {
+            struct vec2d point = Rotate(HemispherePoints[qq], offset);
+            float r = sqrtf(point.x), phi = 2 * 3.14159265f * point.y, up = sqrtf(1.f - point.x);
+            float across = r * cosf(phi), along = r * sinf(phi);
+            struct vec3d rvec =
+            {
+                tangent.x * across + bitangent.x * along + normal.x * up,
+                tangent.y * across + bitangent.y * along + normal.y * up,
+                tangent.z * across + bitangent.z * along + normal.z * up
+            };
+
+            struct vec3d target =
+            {
+                source.x + rvec.x * 512.f,
+                source.y + rvec.y * 512.f,
+                source.z + rvec.z * 512.f
+            };
+
+            AddRay(&packet, source, sectorno, target);
+        }
+
+        TracePacket(&packet, hits);
+
+        for(unsigned n = 0; n < packet.count; ++n)
+        {
+            if(packet.result[n] != 1)
+                continue;
+
+            const struct Intersection* i = &hits[n];
+            unsigned m = i->lightmap - Lightmaps;
+            sources[m / 8] |= 1 << (m % 8);
+
+            float cosine = vdot3(perturbed_normal.x, i->normal.x,
+                                 perturbed_normal.y, i->normal.y,
+                                 perturbed_normal.z, i->normal.z) * basepower;
+
+            float len = vlen(i->where.x - source.x, i->where.y - source.y, i->where.z - source.z);
+            float power = abs(cosine) / (1.f + powf(len / fade_distance_radiosity, 2.0f));
+            inverse_distances += 1.f / max(len, 1e-3f);
+
+            color.x += i->sample.x * power;
+            color.y += i->sample.y * power;
+            color.z += i->sample.z * power;
+        }
+    }
+
+    // Rays that hit nothing are infinitely far.
+    *nearby = inverse_distances > 0 ? nrandomvectors / inverse_distances : 1e30f;
+    return color;
+}
+
+// FillGaps: Copy over each of `count` runs of `span` texels of `size` bytes (`stride` apart) that `have` says is
+// empty the nearest run that is not.
+static void FillGaps(char* texels, size_t size, const unsigned char* have, unsigned count, unsigned stride, unsigned span,
+                     int* nearest)
+{
+    int last = -1;
+    for(unsigned k = 0; k < count; ++k)
+    {
+        if(have[k])
+            last = k;
+        nearest[k] = last;
+    }
+
+    int next = -1;
+    for(unsigned k = count; k-- > 0; )
+    {
+        if(have[k])
+        {
+            next = k;
             continue;
+        }
+
+        int prev = nearest[k];
+        int from = prev < 0 ? next : next < 0 ? prev : ((int)k - prev <= next - (int)k ? prev : next);
+        if(from >= 0)
+            memcpy(texels + k * stride * size, texels + from * stride * size, size * span);
+    }
+}
+
+// FillUncovered: Give the texels of level 0 of a lightmap (or a light plane, with texels of `size` bytes) that are
+// not on the surface the light of the nearest covered texel in their row, and rows without covered texels the
+// light of the nearest row that has some.
+static void FillUncovered(const struct lightmap* map, void* texels, size_t size)
+{
+    unsigned width = map->width, height = map->height;
+    if(map->covered == 0 || map->covered == width * height)
+        return;
+
+    int* nearest = malloc(sizeof(int) * max(width, height));
+    unsigned char* rows = malloc(width);
+    for(unsigned a = 0; a < width; ++a)
+    {
+        rows[a] = memchr(map->coverage + a * height, 1, height) != NULL;
+        FillGaps((char*)texels + a * height * size, size, map->coverage + a * height, height, 1, 1, nearest);
+    }
+
+    FillGaps(texels, size, rows, width, height, height, nearest);
+    free(rows);
+    free(nearest);
+}
+
+#if LightmapFormat != 0
+// EncodeRGB565: The 5:6:5 color nearest to red, green and blue from 0 to 255.
+static unsigned EncodeRGB565(float r, float g, float b)
+{
+    unsigned r5 = clamp(r, 0, 255) * 31 / 255 + 0.5f, g6 = clamp(g, 0, 255) * 63 / 255 + 0.5f;
+    unsigned b5 = clamp(b, 0, 255) * 31 / 255 + 0.5f;
+    return r5 << 11 | g6 << 5 | b5;
+}
+#endif
+
+#if LightmapFormat == 2
+// IndexBlock: Give each of 16 texels the index of the nearest of the four colors of a block with the given two
+// colors (bits 0..31). Adds up the squared errors in `error`.
+static unsigned long long IndexBlock(unsigned long long block, const float color[16][3], float* error)
+{
+    int palette[4];
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        palette[i] = DecodeBlockTexel(block | (unsigned long long)i << 32, 0);
+    }
+
+    *error = 0;
+    for(unsigned k = 0; k < 16; ++k)
+    {
+        unsigned best = 0;
+        float nearest = 1e9f;
+        for(unsigned i = 0; i < 4; ++i)
+        {
+            float dr = ((palette[i] >> 16) & 0xFF) - color[k][0];
+            float dg = ((palette[i] >>  8) & 0xFF) - color[k][1];
+            float db = (palette[i] & 0xFF) - color[k][2];
+            if(dr*dr + dg*dg + db*db < nearest)
+            {
+                nearest = dr*dr + dg*dg + db*db;
+                best = i;
+            }
+        }
+
+        block |= (unsigned long long)best << (32 + 2*k);
+        *error += nearest;
+    }
+
+    return block;
+}
+
+// EncodeBlock: A 4x4 block from 16 packed texels, in DecodeBlockTexel order. Its colors start as the ends of
+// the line through the texels along which they spread the most, and are then fitted to the indices they got.
+static unsigned long long EncodeBlock(const int texels[16])
+{
+    float color[16][3], mean[3] = { 0, 0, 0 }, cov[3][3] = { { 0 } };
+    for(unsigned k = 0; k < 16; ++k)
+    {
+        for(unsigned c = 0; c < 3; ++c)
+        {
+            color[k][c] = (texels[k] >> (16 - 8*c)) & 0xFF;
+            mean[c] += color[k][c] / 16;
+        }
+    }
+
+    for(unsigned k = 0; k < 16; ++k)
+    {
+        for(unsigned c = 0; c < 3; ++c)
+            for(unsigned d = 0; d < 3; ++d)
+                cov[c][d] += (color[k][c] - mean[c]) * (color[k][d] - mean[d]);
+    }
+
+    // The direction of most spread, by power iteration from gray. Lightmaps have little else than brightness.
+    float axis[3] = { 1, 1, 1 };
+    for(unsigned iteration = 0; iteration < 4; ++iteration)
+    {
+        float next[3], largest = 0;
+        for(unsigned c = 0; c < 3; ++c)
+        {
+            next[c] = cov[c][0] * axis[0] + cov[c][1] * axis[1] + cov[c][2] * axis[2];
+            largest = max(largest, abs(next[c]));
+        }
+
+        for(unsigned c = 0; c < 3; ++c)
+            axis[c] = largest > 1e-6f ? next[c] / largest : 0;
+    }
+
+    float length = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2], lo = 0, hi = 0;
+    for(unsigned k = 0; k < 16 && length > 0; ++k)
+    {
+        float t = ((color[k][0] - mean[0]) * axis[0] + (color[k][1] - mean[1]) * axis[1]
+                 + (color[k][2] - mean[2]) * axis[2]) / length;
+        lo = min(lo, t);
+        hi = max(hi, t);
+    }
+
+    float error, fitted;
+    unsigned long long block = IndexBlock(
+        EncodeRGB565(mean[0] + lo * axis[0], mean[1] + lo * axis[1], mean[2] + lo * axis[2])
+        | (unsigned long long)EncodeRGB565(mean[0] + hi * axis[0], mean[1] + hi * axis[1], mean[2] + hi * axis[2]) << 16,
+        color, &error);
+
+    // Least squares: the two colors that the texels, mixed as their indices say, are nearest to.
+    static const float weights[4] = { 0, 1, 1/3.f, 2/3.f };
+    float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+    for(unsigned k = 0; k < 16; ++k)
+    {
+        float t = weights[(block >> (32 + 2*k)) & 3];
+        aa += (1 - t) * (1 - t);
+        ab += (1 - t) * t;
+        bb += t * t;
+        for(unsigned c = 0; c < 3; ++c)
+        {
+            ax[c] += (1 - t) * color[k][c];
+            bx[c] += t * color[k][c];
+        }
+    }
+
+    float det = aa * bb - ab * ab;
+    if(abs(det) > 1e-3f)
+    {
+        float c0[3], c1[3];
+        for(unsigned c = 0; c < 3; ++c)
+        {
+            c0[c] = (bb * ax[c] - ab * bx[c]) / det;
+            c1[c] = (aa * bx[c] - ab * ax[c]) / det;
+        }
+
+        unsigned long long refit = IndexBlock(EncodeRGB565(c0[0], c0[1], c0[2])
+            | (unsigned long long)EncodeRGB565(c1[0], c1[1], c1[2]) << 16, color, &fitted);
+        if(fitted < error)
+            block = refit;
+    }
+
+    return block;
+}
+#endif
+
+#if LightmapFormat != 0
+// EncodeLightmapLevel: Store a mip level of a lightmap, given as packed texels in flat rows, in LightmapFormat.
+static void EncodeLightmapLevel(struct lightmap* map, unsigned level, const int* texels)
+{
+    unsigned width = LightmapLevelSize(map->width, level), height = LightmapLevelSize(map->height, level);
+    LightmapUnit* units = map->mips + map->mipoffset[level];
+#if LightmapFormat == 2
+    // Blocks at the far edges of levels that are not a multiple of 4 repeat the last row or column.
+    for(unsigned a = 0; a < width; a += 4)
+    {
+        for(unsigned b = 0; b < height; b += 4)
+        {
+            int block[16];
+            for(unsigned k = 0; k < 16; ++k)
+            {
+                block[k] = texels[min(a + k/4, width - 1) * height + min(b + k%4, height - 1)];
+            }
+
+            *units++ = EncodeBlock(block);
+        }
+    }
+#elif LightmapFormat == 1
+    for(unsigned n = 0; n < width * height; ++n)
+    {
+        units[n] = EncodeRGB565((texels[n] >> 16) & 0xFF, (texels[n] >> 8) & 0xFF, texels[n] & 0xFF);
+    }
+#endif
+}
+#endif
+
+// GenerateLightmapMipmaps: GenerateMipmaps() for a lightmap, whose levels need not be square, from its level 0.
+// With LightmapFormat 0 the levels are built in place; otherwise they are built aside and then encoded.
+static void GenerateLightmapMipmaps(struct lightmap* map)
+{
+#if LightmapFormat == 0
+    int* chain = map->texels;
+#else
+    // A chain holds less than twice as many texels as its level 0.
+    int* chain = malloc(sizeof(int) * 2 * map->width * map->height);
+    memcpy(chain, map->texels, sizeof(int) * map->width * map->height);
+#endif
+    int* plane = chain;
+    for(unsigned level = 1; level < map->miplevels; ++level)
+    {
+        const int* above = plane;
+        plane += LightmapLevelSize(map->width, level - 1) * LightmapLevelSize(map->height, level - 1);
+        unsigned width  = LightmapLevelSize(map->width, level), height = LightmapLevelSize(map->height, level);
+        unsigned awidth = LightmapLevelSize(map->width, level - 1), aheight = LightmapLevelSize(map->height, level - 1);
+        for(unsigned a = 0; a < width; ++a)
+        {
+            for(unsigned b = 0; b < height; ++b)
+            {
+                unsigned a0 = a*2, a1 = min(a*2 + 1, awidth - 1);
+                unsigned b0 = b*2, b1 = min(b*2 + 1, aheight - 1);
+                int c0 = above[a0 * aheight + b0];
+                int c1 = above[a1 * aheight + b0];
+                int c2 = above[a0 * aheight + b1];
+                int c3 = above[a1 * aheight + b1];
+                int r = (((c0 >> 16) & 0xFF) + ((c1 >> 16) & 0xFF) + ((c2 >> 16) & 0xFF) + ((c3 >> 16) & 0xFF) + 2) / 4;
+                int g = (((c0 >>  8) & 0xFF) + ((c1 >>  8) & 0xFF) + ((c2 >>  8) & 0xFF) + ((c3 >>  8) & 0xFF) + 2) / 4;
+                int b_ = ((c0 & 0xFF) + (c1 & 0xFF) + (c2 & 0xFF) + (c3 & 0xFF) + 2) / 4;
+                plane[a * height + b] = r * 65536 + g * 256 + b_;
+            }
+        }
+    }
+
+#if LightmapFormat != 0
+    plane = chain;
+    for(unsigned level = 0; level < map->miplevels; ++level)
+    {
+        EncodeLightmapLevel(map, level, plane);
+        plane += LightmapLevelSize(map->width, level) * LightmapLevelSize(map->height, level);
+    }
+
+    free(chain);
+#endif
+}
+
+// UnpackLight: Light plane from packed texels.
+static void UnpackLight(float* light, const int* texels, unsigned count)
+{
+    for(unsigned n = 0; n < count; ++n)
+    {
+        light[n*3 + 0] = (texels[n] >> 16) & 0xFF;
+        light[n*3 + 1] = (texels[n] >>  8) & 0xFF;
+        light[n*3 + 2] = (texels[n] >>  0) & 0xFF;
+    }
+}
+
+static void Begin_Radiosity(struct lightmap* map)
+{
+    memset(TileChanges + map->firsttile, 0, sizeof(*TileChanges) * LightmapTiles(map));
+}
+
+// End_Radiosity: Fill in the light plane of the round around the surface, where the rays of the next round
+// may read it. The differences are how much it changed from the last round, which the tiles summed up while
+// they were baked. The texels get the light only when the bake is done (PackRadiosity).
+static double End_Radiosity(struct lightmap* map, unsigned round, const char* label)
+{
+    double differences = 0;
+    for(unsigned t = 0; t < LightmapTiles(map); ++t)
+    {
+        differences += TileChanges[map->firsttile + t];
+    }
+
+    FillUncovered(map, map->light[round % 2], sizeof(float) * 3);
+
+    double result = differences / (double)max(map->covered, 1u);
+    fprintf(stderr, "Differences in %s: %g\33[K\n", label, result);
+    return result;
+}
+
+// PackRadiosity: Make the light of the last round the lightmap's texels.
+static void PackRadiosity(struct lightmap* map, unsigned round)
+{
+    const float* light = map->light[round % 2];
+    for(unsigned n = 0; n < map->width * map->height; ++n)
+    {
+        PutColor(&map->texels[n], (struct vec3d) { light[n*3 + 0], light[n*3 + 1], light[n*3 + 2] });
+    }
+
+    GenerateLightmapMipmaps(map);
+    SyncCache(map->texels, LightmapBytes(map));
+}
+
+static void End_Diffuse(struct lightmap* map)
+{
+    FillUncovered(map, map->texels, sizeof(int));
+    memcpy(map->diffuseonly, map->texels, sizeof(int) * map->width * map->height);
+    GenerateLightmapMipmaps(map);
+}
+
+// AverageNormal: The normal map under lightmap texel (a,b). A lightmap texel usually spans many texture
+// texels, and one sample of their bumps would make the light blotchy; average up to 4x4 of them.
+static int AverageNormal(const struct lightmap* map, const int* normalmap, unsigned a, unsigned b)
+{
+    float du = map->texscale / map->scale_u, dv = map->texscale / map->scale_v;
+    float u0 = (map->origin_u + a / map->scale_u) * map->texscale;
+    float v0 = (map->origin_v + b / map->scale_v) * map->texscale;
+    unsigned nu = clamp((int)du, 1, 4), nv = clamp((int)dv, 1, 4);
+
+    int r = 0, g = 0, b_ = 0;
+    for(unsigned i = 0; i < nu; ++i)
+    {
+        for(unsigned j = 0; j < nv; ++j)
+        {
+            unsigned tx = (unsigned)(int)(u0 + (i + 0.5f) * du / nu) % 1024u;
+            unsigned ty = (unsigned)(int)(v0 + (j + 0.5f) * dv / nv) % 1024u;
+            int sample = Texel(normalmap, tx, ty);
+            r  += (sample >> 16) & 0xFF;
+            g  += (sample >>  8) & 0xFF;
+            b_ += sample & 0xFF;
+        }
+    }
+
+    int n = nu * nv;
+    return (r + n/2) / n * 65536 + (g + n/2) / n * 256 + (b_ + n/2) / n;
+}
+
+/**************************************** IRRADIANCE CACHE *****************************************/
+/* The light that the surfaces reflect changes slowly over a surface, so radiosity is not gathered */
+/* at every texel. Each tile is cut into cells of irradiance_spacing texels, gathered at their     */
+/* corners and interpolated in between. A cell is cut in four again while its corners differ too   */
+/* much, are off the surface (at the edge of a portal hole), or are close to other surfaces        */
+/* compared to its size (in a corner of the room), down to single texels that are all gathered.    */
+/***************************************************************************************************/
+
+struct irradiancecache
+{
+    const struct lightmap* map;
+    const struct TextureSet* set;       // For the normal map
+    unsigned sectorno;
+    struct vec3d normal, tangent, bitangent;
+    unsigned a0, b0;                    // First texel of the tile
+    unsigned char* sources;             // Lightmaps gathered from, a bit each
+    unsigned samples;                   // Number of texels gathered
+    unsigned char state[BakeTileSize][BakeTileSize];    // IrradianceNone, IrradianceInterpolated, IrradianceGathered
+    float nearby[BakeTileSize][BakeTileSize];           // Harmonic mean distance of what is around the texel
+    struct vec3d light[BakeTileSize][BakeTileSize];     // Reflected light on the texel
+};
+
+#define IrradianceNone          0
+#define IrradianceInterpolated  1
+#define IrradianceGathered      2
+
+// Texels gathered and texels baked in the radiosity round, for the statistics
+static unsigned long IrradianceSamples = 0, IrradianceTexels = 0;
+
+// TexelPoint: The center of lightmap texel (a,b) on the map.
+static struct vec3d TexelPoint(const struct lightmap* map, unsigned a, unsigned b)
+{
+    return (struct vec3d)
+    {
+        map->corner.x + (a + 0.5f) * map->axis_u.x + (b + 0.5f) * map->axis_v.x,
+        map->corner.y + (a + 0.5f) * map->axis_u.y + (b + 0.5f) * map->axis_v.y,
+        map->corner.z + (a + 0.5f) * map->axis_u.z + (b + 0.5f) * map->axis_v.z
+    };
+}
+
+// GatherIrradiance: Gather the reflected light at texel (a,b) of the tile, unless it is gathered already.
+// Returns 0 if the texel is not on the surface.
+static int GatherIrradiance(struct irradiancecache* c, unsigned a, unsigned b)
+{
+    const struct lightmap* map = c->map;
+    unsigned ma = c->a0 + a, mb = c->b0 + b;
+    if(!map->coverage[ma * map->height + mb])
+        return 0;
+
+    if(c->state[a][b] != IrradianceGathered)
+    {
+        c->light[a][b] = RadiosityCalculation(c->normal, c->tangent, c->bitangent, AverageNormal(map, c->set->normalmap, ma, mb),
+                                              TexelPoint(map, ma, mb), c->sectorno, TexelSampleOffset(map, ma, mb),
+                                              c->sources, &c->nearby[a][b]);
+        c->state[a][b] = IrradianceGathered;
+        c->samples += 1;
+    }
+
+    return 1;
+}
+
+// RefineIrradiance: Fill in the light of the texels from a0,b0 to a1,b1 (inclusive) of the tile.
+static void RefineIrradiance(struct irradiancecache* c, unsigned a0, unsigned b0, unsigned a1, unsigned b1)
+{
+    const unsigned ca[4] = { a0, a1, a0, a1 }, cb[4] = { b0, b0, b1, b1 };
+    int smooth = 1;
+    for(unsigned k = 0; k < 4; ++k)
+    {
+        smooth &= GatherIrradiance(c, ca[k], cb[k]);
+    }
+
+    if(smooth)
+    {
+        // The size of the cell on the map
+        float du = (a1 - a0) * vlen(c->map->axis_u.x, c->map->axis_u.y, c->map->axis_u.z);
+        float dv = (b1 - b0) * vlen(c->map->axis_v.x, c->map->axis_v.y, c->map->axis_v.z);
+        float size = sqrtf(du * du + dv * dv);
+        struct vec3d low = c->light[a0][b0], high = low;
+        for(unsigned k = 0; k < 4; ++k)
+        {
+            struct vec3d l = c->light[ca[k]][cb[k]];
+            low  = (struct vec3d) { min(low.x, l.x), min(low.y, l.y), min(low.z, l.z) };
+            high = (struct vec3d) { max(high.x, l.x), max(high.y, l.y), max(high.z, l.z) };
+            smooth &= size <= irradiance_accuracy * c->nearby[ca[k]][cb[k]];
+        }
+
+        smooth &= high.x - low.x <= irradiance_error && high.y - low.y <= irradiance_error && high.z - low.z <= irradiance_error;
+    }
+
+    if(smooth)
+    {
+        for(unsigned a = a0; a <= a1; ++a)
+        {
+            for(unsigned b = b0; b <= b1; ++b)
+            {
+                if(c->state[a][b] != IrradianceNone || !c->map->coverage[(c->a0 + a) * c->map->height + c->b0 + b])
+                    continue;
+
+                float u = a1 > a0 ? (a - a0) / (float)(a1 - a0) : 0, v = b1 > b0 ? (b - b0) / (float)(b1 - b0) : 0;
+                float w[4] = { (1-u) * (1-v), u * (1-v), (1-u) * v, u * v };
+                struct vec3d l = { 0, 0, 0 };
+                for(unsigned k = 0; k < 4; ++k)
+                {
+                    l.x += c->light[ca[k]][cb[k]].x * w[k];
+                    l.y += c->light[ca[k]][cb[k]].y * w[k];
+                    l.z += c->light[ca[k]][cb[k]].z * w[k];
+                }
+
+                c->light[a][b] = l;
+                c->state[a][b] = IrradianceInterpolated;
+            }
+        }
+    }
+    else if(a1 - a0 > 1 || b1 - b0 > 1)
+    {
+        // Cut in halves along each side that still has texels in between. A cell of two texels
+        // across has nothing but its corners, and they are gathered already.
+        unsigned am = a1 - a0 > 1 ? (a0 + a1) / 2 : a1, bm = b1 - b0 > 1 ? (b0 + b1) / 2 : b1;
+        RefineIrradiance(c, a0, b0, am, bm);
+        if(am < a1)
+            RefineIrradiance(c, am, b0, a1, bm);
+        if(bm < b1)
+            RefineIrradiance(c, a0, bm, am, b1);
+        if(am < a1 && bm < b1)
+            RefineIrradiance(c, am, bm, a1, b1);
+    }
+}
+
+/***************************************** BAKE SCHEDULER ******************************************/
+/* A round of the bake is cut into tiles of BakeTileSize x BakeTileSize lightmap texels, over all  */
+/* surfaces of all sectors at once. The tiles are sorted by their estimated number of rays, most   */
+/* first, and one team of threads keeps taking the next tile off the list until it is empty, so    */
+/* the long tiles start early and the short ones fill the gaps at the end. Radiosity reads the     */
+/* light of the previous round from one light plane of each lightmap while it bakes the next       */
+/* round into the other one.                                                                       */
+/***************************************************************************************************/
+
+// A radiosity tile is skipped when its texels changed less than this much on the average in the last round
+// (summed over red, green and blue), and so did every surface it gathered light from. Each round samples
+// other directions, so the texels keep changing by a few steps anyway.
+#define TileConvergence 6.0
+
+struct baketile
+{
+    struct lightmap* map;
+    const struct TextureSet* set;       // For the normal map
+    unsigned sectorno;
+    struct vec3d normal, tangent, bitangent;
+    unsigned a0, a1, b0, b1;            // Texels a0 <= a < a1, b0 <= b < b1
+    unsigned index;                     // In the bake record
+    unsigned long cost;                 // Estimated rays
+};
+
+// PortalDepths: Number of portals between sector `from` and every sector; NumSectors if there is no way,
+// or if `from` is not a sector at all.
+static void PortalDepths(unsigned from, unsigned* depth)
+{
+    unsigned* queue = malloc(sizeof(unsigned) * NumSectors);
+    unsigned head = 0, tail = 0;
+
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        depth[n] = NumSectors;
+    }
+
+    if(from < NumSectors)
+    {
+        depth[from] = 0;
+        queue[tail++] = from;
+    }
+
+    while(head < tail)
+    {
+        const struct sector* sect = &sectors[queue[head++]];
+        for(unsigned s = 0; s < sect->nPoints; ++s)
+        {
+            int neighbor = sect->neighbors[s];
+            if(neighbor >= 0 && depth[neighbor] == NumSectors)
+            {
+                depth[neighbor] = depth[sect - sectors] + 1;
+                queue[tail++] = neighbor;
+            }
+        }
+    }
+
+    free(queue);
+}
+
+// AddSurfaceTiles: Append the tiles of one surface that have covered texels. texelcost is the estimated
+// number of rays per texel; the tiles to skip only copy their texels.
+static void AddSurfaceTiles(struct baketile* tiles, unsigned* ntiles, struct lightmap* map, const struct TextureSet* set,
+                            unsigned sectorno, struct vec3d normal, struct vec3d tangent, struct vec3d bitangent,
+                            unsigned long texelcost)
+{
+    for(unsigned a0 = 0; a0 < map->width; a0 += BakeTileSize)
+    {
+        for(unsigned b0 = 0; b0 < map->height; b0 += BakeTileSize)
+        {
+            struct baketile tile = { map, set, sectorno, normal, tangent, bitangent,
+                                     a0, min(a0 + BakeTileSize, map->width), b0, min(b0 + BakeTileSize, map->height),
+                                     map->firsttile + a0 / BakeTileSize * LightmapTileSpan(map->height) + b0 / BakeTileSize, 0 };
+            unsigned long cost = TileSkip[tile.index] ? 1 : texelcost;
+            for(unsigned a = tile.a0; a < tile.a1; ++a)
+            {
+                for(unsigned b = tile.b0; b < tile.b1; ++b)
+                {
+                    tile.cost += map->coverage[a * map->height + b] * cost;
+                }
+            }
+
+            if(tile.cost > 0)
+                tiles[(*ntiles)++] = tile;
+        }
+    }
+}
+
+static int CompareTileCost(const void* a, const void* b)
+{
+    unsigned long ca = ((const struct baketile*)a)->cost, cb = ((const struct baketile*)b)->cost;
+    return (ca < cb) - (ca > cb);
+}
+
+// BakeRadiosityTile: Gather the reflected light of one tile of round `round` through the irradiance cache, and
+// count how much its light changed from the last round, unless it is skipped and keeps the last round's light.
+static void BakeRadiosityTile(const struct baketile* tile, unsigned round)
+{
+    struct lightmap* map = tile->map;
+    float* light = map->light[round % 2];
+    const float* last = map->light[(round + 1) % 2];
+    if(TileSkip[tile->index])
+    {
+        for(unsigned a = tile->a0; a < tile->a1; ++a)
+        {
+            unsigned n = a * map->height + tile->b0;
+            memcpy(&light[n * 3], &last[n * 3], sizeof(float) * 3 * (tile->b1 - tile->b0));
+        }
+        return;
+    }
+
+    // Nothing is gathered yet: every texel starts out IrradianceNone, with no light.
+    struct irradiancecache cache = { .map = map, .set = tile->set, .sectorno = tile->sectorno,
+                                     .normal = tile->normal, .tangent = tile->tangent, .bitangent = tile->bitangent,
+                                     .a0 = tile->a0, .b0 = tile->b0,
+                                     .sources = TileSources + (size_t)tile->index * TileSourceBytes, .samples = 0,
+                                     .state = { { IrradianceNone } }, .nearby = { { 0 } }, .light = { { { 0 } } } };
+    memset(cache.sources, 0, TileSourceBytes);
+
+    unsigned na = tile->a1 - tile->a0, nb = tile->b1 - tile->b0;
+    for(unsigned a = 0; a == 0 || a + 1 < na; a += irradiance_spacing)
+    {
+        for(unsigned b = 0; b == 0 || b + 1 < nb; b += irradiance_spacing)
+        {
+            RefineIrradiance(&cache, a, b, min(a + irradiance_spacing, na - 1), min(b + irradiance_spacing, nb - 1));
+        }
+    }
+
+    // The diffuse light and the reflected light on top of it
+    double change = 0;
+    unsigned covered = 0;
+    for(unsigned a = tile->a0; a < tile->a1; ++a)
+    {
+        for(unsigned b = tile->b0; b < tile->b1; ++b)
+        {
+            unsigned n = a * map->height + b;
+            if(!map->coverage[n])
+                continue;
+
+            int diffuse = map->diffuseonly[n];
+            struct vec3d reflected = cache.light[a - tile->a0][b - tile->b0];
+            light[n*3 + 0] = ((diffuse >> 16) & 0xFF) + reflected.x;
+            light[n*3 + 1] = ((diffuse >>  8) & 0xFF) + reflected.y;
+            light[n*3 + 2] = ((diffuse >>  0) & 0xFF) + reflected.z;
+            covered += 1;
+
+            change += fabsf(light[n*3 + 0] - last[n*3 + 0])
+                    + fabsf(light[n*3 + 1] - last[n*3 + 1])
+                    + fabsf(light[n*3 + 2] - last[n*3 + 2]);
+        }
+    }
+
+    TileChanges[tile->index] = change;
+
+    #pragma omp atomic
+    IrradianceSamples += cache.samples;
+    #pragma omp atomic
+    IrradianceTexels += covered;
+}
+
+static void BakeTile(const struct baketile* tile, unsigned round)
+{
+    struct lightmap* map = tile->map;
+    if(round > 1)
+    {
+        BakeRadiosityTile(tile, round);
+        return;
+    }
+
+    for(unsigned a = tile->a0; a < tile->a1; ++a)
+    {
+        for(unsigned b = tile->b0; b < tile->b1; ++b)
+        {
+            if(!map->coverage[a * map->height + b])
+                continue;
+
+            int normal_sample = AverageNormal(map, tile->set->normalmap, a, b);
+            DiffuseLightCalculation(tile->normal, tile->tangent, tile->bitangent, normal_sample,
+                                    &map->texels[a * map->height + b], TexelPoint(map, a, b), tile->sectorno,
+                                    TexelSampleOffset(map, a, b));
+        }
+    }
+}
+
+// JournalSurfaceBaked: Note in the journal that all texels of lightmap m are baked in this round, once they are on the disk.
+static void JournalSurfaceBaked(unsigned m, unsigned round)
+{
+    const struct lightmap* map = &Lightmaps[m];
+    if(round == 1)
+        SyncCache(map->texels, sizeof(int) * map->width * map->height);
+    else
+    {
+        SyncCache(map->light[round % 2], sizeof(float) * 3 * map->width * map->height);
+        SyncCache(TileChanges + map->firsttile, sizeof(*TileChanges) * LightmapTiles(map));
+        SyncCache(TileSources + (size_t)map->firsttile * TileSourceBytes, TileSourceBytes * LightmapTiles(map));
+    }
+    BakeJournalSurfaces[m] = SurfaceBaked;
+    SyncCache(&BakeJournalSurfaces[m], 1);
+}
 
-        // Determine the X and Z coordinates of the wall hit.
-        struct vec2d hit = Intersect(origin.x, origin.z, target.x, target.z, vx1, vy1, vx2, vy2);
-        float x = hit.x;
-        float z = hit.y;
+// BakeRound: Bake one round (1 = diffuse light, 2.. = radiosity) of the surfaces of the sectors marked in `bake`
+// that the journal says are still waiting for it.
+static void BakeRound(unsigned round, const unsigned char* bake)
+{
+    unsigned ntiles = 0;
+    struct baketile* tiles = malloc(sizeof(struct baketile) * NumBakeTiles);
 
-        // Also determine the Y coordinate
-        float y = origin.y + ((abs(target.x - origin.x) > abs(target.z-origin.z))
-                                ? ((x - origin.x) * (target.y - origin.y) / (target.x - origin.x))
-                                : ((z - origin.z) * (target.y - origin.y) / (target.z - origin.z)));
+    // Diffuse rays go to each point of each light that can reach the sector, and cross the portals on
+    // the way there; radiosity rays go everywhere, so count the ways out of the sector instead.
+    unsigned* depths = malloc(sizeof(unsigned) * NumSectors * max(NumLights, 1u));
+    for(unsigned l = 0; l < NumLights; ++l)
+    {
+        PortalDepths(lights[l].sector, depths + l * NumSectors);
+    }
 
-        // Check where the hole is.
-        float hole_low = 9e9, hole_high = -9e9;
+    for(unsigned sectorno = 0; sectorno < NumSectors; ++sectorno)
+    {
+        if(!bake[sectorno])
+            continue;
 
-        if(sect->neighbors[s] >= 0)
+        struct sector* const sect = &sectors[sectorno];
+        unsigned long texelcost = 0;
+        if(round == 1)
         {
-            hole_low = max(sect->floor, sectors[sect->neighbors[s]].floor);
-            hole_high = min(sect->ceil, sectors[sect->neighbors[s]].ceil);        
+            for(unsigned k = SectorLightStart[sectorno]; k < SectorLightStart[sectorno + 1]; ++k)
+            {
+                texelcost += narealightcomponents * (1 + depths[SectorLightList[k] * NumSectors + sectorno]);
+            }
+        }
+        else
+        {
+            unsigned portals = 0;
+            for(unsigned s = 0; s < sect->nPoints; ++s)
+            {
+                portals += sect->neighbors[s] >= 0;
+            }
+            texelcost = nrandomvectors * (1 + portals);
         }
 
-        if(y >= hole_low && y <= hole_high)
+        // Floors and ceilings
+        struct vec3d floornormal    = (struct vec3d){0, 1, 0}; // floor
+        struct vec3d floortangent   = (struct vec3d){1, 0, 0};
+        struct vec3d floorbitangent = vxs3(floornormal.x, floornormal.y, floornormal.z, floortangent.x, floortangent.y, floortangent.z);
+        struct vec3d ceilnormal     = (struct vec3d){0, -1, 0}; // ceiling
+        struct vec3d ceiltangent    = (struct vec3d){1, 0, 0};
+        struct vec3d ceilbitangent  = vxs3(ceilnormal.x, ceilnormal.y, ceilnormal.z, ceiltangent.x, ceiltangent.y, ceiltangent.z);
+
+        #define Waiting(map) (BakeJournalSurfaces[(map) - Lightmaps] == SurfaceWaiting)
+        if(Waiting(sect->floorlightmap))
+            AddSurfaceTiles(tiles, &ntiles, sect->floorlightmap, sect->floortexture, sectorno,
+                            floornormal, floortangent, floorbitangent, texelcost);
+        if(Waiting(sect->ceillightmap))
+            AddSurfaceTiles(tiles, &ntiles, sect->ceillightmap, sect->ceiltexture, sectorno,
+                            ceilnormal, ceiltangent, ceilbitangent, texelcost);
+
+        // Walls; the hole of a portal is in neither of its lightmaps.
+        for(unsigned s = 0; s < sect->nPoints; ++s)
         {
-            // the point fit in between  this hole.
-            origin_sectorno = sect->neighbors[s];
-            origin.x        = x + (target.x - origin.x)*1e-2;
-            origin.y        = y + (target.y - origin.y)*1e-2;
-            origin.z        = z + (target.z - origin.z)*1e-2;
+            unsigned w = Geometry.firstwall[sectorno] + s;
+            if(Waiting(&sect->upperlightmaps[s]))
+                AddSurfaceTiles(tiles, &ntiles, &sect->upperlightmaps[s], sect->uppertextures[s], sectorno,
+                                WallNormal(w), WallTangent(w), (struct vec3d){0, 1, 0}, texelcost);
+            if(Waiting(&sect->lowerlightmaps[s]))
+                AddSurfaceTiles(tiles, &ntiles, &sect->lowerlightmaps[s], sect->lowertextures[s], sectorno,
+                                WallNormal(w), WallTangent(w), (struct vec3d){0, 1, 0}, texelcost);
+        }
+        #undef Waiting
+    }
 
-            float distance = vlen(target.x - origin.x, target.y - origin.y, target.z - origin.z);
+    free(depths);
+    qsort(tiles, ntiles, sizeof(struct baketile), CompareTileCost);
 
-            if(origin_sectorno == prev_sectorno)
-            {
-                continue;
-            }
-            if(distance < 1e-3f || origin_sectorno == prev_sectorno)
-            {
-                goto close_enough;
-            }
+    // A surface is baked when the last of its tiles is.
+    unsigned* tilesleft = calloc(NumLightmaps, sizeof(unsigned));
+    unsigned long totalcost = 0;
+    unsigned skipped = 0;
+    for(unsigned t = 0; t < ntiles; ++t)
+    {
+        totalcost += tiles[t].cost;
+        tilesleft[tiles[t].map - Lightmaps] += 1;
+        skipped += round > 1 && TileSkip[tiles[t].index];
+    }
 
-            prev_sectorno = origin_sectorno;
-            goto rescan;
+    if(round > 1)
+    {
+        for(unsigned m = 0; m < NumLightmaps; ++m)
+        {
+            if(tilesleft[m] > 0)
+                Begin_Radiosity(&Lightmaps[m]);
         }
+    }
 
-        // Hit the road jack
-        if(y < sect->floor)
-            goto hit_floor;
-        // D:! hit the ceil
-        if(y > sect->ceil)
-            goto hit_ceil;
+    fprintf(stderr, "- %u tiles of up to %ux%u texels\n", ntiles, BakeTileSize, BakeTileSize);
+    if(round > 1)
+        fprintf(stderr, "- %u of them have converged and are skipped\n", skipped);
 
-        // Oh now hit the wall!
-        result->where       = (struct vec3d) { x, y, z};
-        result->surface     = (y < hole_low) ? &sect->lowertextures[s] : &sect->uppertextures[s];
-        result->sectorno    = origin_sectorno;
+    IrradianceSamples = 0;
+    IrradianceTexels = 0;
 
-        float nx  = vy2-vy1;
-        float nz  = vx1-vx2;
-        float len = sqrtf(nx*nx + nz*nz);
+    unsigned next = 0, reported = ~0u;
+    unsigned long done = 0;
+    #pragma omp parallel
+    {
+        for(;;)
+        {
+            unsigned t;
+            #pragma omp atomic capture
+            t = next++;
 
-        result->normal = (struct vec3d){ nx/len, 0, nz/len };
+            if(t >= ntiles)
+                break;
 
-        nx  = vx2 - vx1;
-        nz  = vy2 - vy1;
-        len = sqrtf(nx * nx + nz * nz);
-        tangent = (struct vec3d){ nx/len, 0, nz/len };
-        bitangent = (struct vec3d){ 0, 1, 0};
+            BakeTile(&tiles[t], round);
 
-        // Calculate the texture coordinates.
-        float dx = vx2 - vx1;
-        float dy = vy2 - vy1;
+            unsigned m = tiles[t].map - Lightmaps, left;
+            #pragma omp atomic capture
+            left = --tilesleft[m];
 
-        v = (unsigned)((y - sect->floor) * 1024.0f / (sect->ceil - sect->floor)) % 1024u;
-        u = (abs(dx) > abs(dy) ? (unsigned)((x-vx1)*1024/dx)
-                               : (unsigned)((z-vy1)*1024/dy)) % 1024u;
+            if(left == 0)
+                JournalSurfaceBaked(m, round);
 
-        // Lightmap coordinate are the same as texture coordinates.
-        lu = u;
-        lv = v;
+            unsigned long now;
+            #pragma omp atomic capture
+            now = done += tiles[t].cost;
 
-    perturb_normal:;
-        int texture_sample = result->surface->texture[v][u];
-        int normal_sample  = result->surface->normalmap[v][u];
-        int light_sample   = result->surface->lightmap[lv][lu];
-        result->sample = ApplyLight(texture_sample, light_sample);
-        result->normal = PerturbNormal(result->normal, tangent, bitangent, normal_sample);
-        return 1;
+            // Only the master thread reports, and only when there is a new tenth of a percent to report.
+            #pragma omp master
+            if(now * 1000 / max(totalcost, 1ul) != reported)
+            {
+                reported = now * 1000 / max(totalcost, 1ul);
+                fprintf(stderr, "- Round %u, %s: %.1f%%, tile %u/%u\33[K\r", round,
+                        round == 1 ? "diffuse light" : "radiosity", reported * 0.1, min(t + 1, ntiles), ntiles);
+            }
+        }
     }
 
-    if(target.y > sect->ceil)
+    fprintf(stderr, "\n");
+    if(round > 1)
+        fprintf(stderr, "- Radiosity gathered at %lu of %lu texels, the rest interpolated\n", IrradianceSamples, IrradianceTexels);
+
+    free(tilesleft);
+    free(tiles);
+}
+
+// LoadRadiosityPlanes: Before radiosity round `round`, give the surfaces that were not baked in the last round of
+// this bake (all when `baked` is NULL) the light of their texels to start from.
+static void LoadRadiosityPlanes(unsigned round, const unsigned char* baked)
+{
+    for(unsigned n = 0; n < NumSectors; ++n)
     {
-        hit_ceil:
-            result->where.y = sect->ceil;
-            result->surface = sect->ceiltexture;
-            result->normal  = (struct vec3d){ 0, -1, 0 };
-            tangent         = (struct vec3d){ 1, 0, 0 };
-            bitangent       = vxs3(result->normal.x, result->normal.y, result->normal.z, tangent.x, tangent.y, tangent.z); 
-        hit_ceil_or_floor:
-            // Either the floor or ceiling was hit. Determine X & Z coordinates.
-            result->where.x = (result->where.y - origin.y) * (target.x - origin.x) / (target.y - origin.y) + origin.x;
-            result->where.z = (result->where.y - origin.y) * (target.z - origin.z) / (target.y - origin.y) + origin.z;
+        const struct sector* sect = &sectors[n];
+        for(struct lightmap* map = sect->floorlightmap; map < sect->lowerlightmaps + sect->nPoints; ++map)
+        {
+            if(!baked || !baked[n] || map->covered == 0)
+                UnpackLight(map->light[(round + 1) % 2], map->texels, map->width * map->height);
+        }
+    }
+}
 
-            // Calculate the texture coordinates.
-            u = ((unsigned)(result->where.x * 256)) % 1024u;
-            v = ((unsigned)(result->where.z * 256)) % 1024u;
+// FinishLightmap: End_Diffuse() or End_Radiosity() of one surface after a round, unless the journal says it
+// is finished already. Returns the radiosity differences, which the journal keeps count of.
+static double FinishLightmap(struct lightmap* map, unsigned round, const char* label)
+{
+    unsigned m = map - Lightmaps;
+    double differences = 0;
+    if(BakeJournalSurfaces[m] == SurfaceFinished)
+        return 0;
+
+    if(map->covered > 0 && round > 1)
+        differences = End_Radiosity(map, round, label);
+    else if(map->covered > 0)
+        End_Diffuse(map);
+
+    if(round > 1)
+        SyncCache(map->light[round % 2], sizeof(float) * 3 * map->width * map->height);
+    else
+        SyncCache(map->texels, LightmapBytes(map));
+    BakeJournal->differences += differences;
+    BakeJournalSurfaces[m] = SurfaceFinished;
+    SyncCache(BakeJournal, sizeof(*BakeJournal));
+    SyncCache(&BakeJournalSurfaces[m], 1);
+    return differences;
+}
 
-            // Calculate the lightmap coordinates.
-            struct vec2d bounding_min = { 1e9f, 1e9f };
-            struct vec2d bounding_max = { -1e9f, -1e9f };
-            GetSectorBoundingBox(origin_sectorno, &bounding_min, &bounding_max);
-            lu = ((unsigned)((result->where.x - bounding_min.x) * 1024 / (bounding_max.x - bounding_min.x))) % 1024;
-            lv = ((unsigned)((result->where.y - bounding_min.y) * 1024 / (bounding_max.y - bounding_min.y))) % 1024;
+// SkipConvergedTiles: After a radiosity round of the sectors marked in `bake`, choose the tiles that the next
+// round skips: the ones that changed less than TileConvergence, and gathered their light only from surfaces
+// that did too.
+static void SkipConvergedTiles(const unsigned char* bake)
+{
+    unsigned char* changed = calloc(TileSourceBytes, 1);
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        const struct sector* sect = &sectors[n];
+        for(const struct lightmap* map = sect->floorlightmap; bake[n] && map < sect->lowerlightmaps + sect->nPoints; ++map)
+        {
+            double change = 0;
+            for(unsigned t = 0; t < LightmapTiles(map); ++t)
+            {
+                change += TileChanges[map->firsttile + t];
+            }
 
-            goto perturb_normal;
+            unsigned m = map - Lightmaps;
+            if(change >= TileConvergence * map->covered)
+                changed[m / 8] |= 1 << (m % 8);
+        }
     }
 
-    if(target.y < sect->floor)
+    for(unsigned n = 0; n < NumSectors; ++n)
     {
-        hit_floor:
-            result->where.y = sect->floor;
-            result->surface = sect->floortexture;
-            result->normal  = (struct vec3d){ 0, 1, 0};
-            tangent         = (struct vec3d){ -1, 0, 0};
-            bitangent       = vxs3(result->normal.x, result->normal.y, result->normal.z, tangent.x, tangent.y, tangent.z); 
-            
-            goto hit_ceil_or_floor;
+        const struct sector* sect = &sectors[n];
+        for(const struct lightmap* map = sect->floorlightmap; bake[n] && map < sect->lowerlightmaps + sect->nPoints; ++map)
+        {
+            for(unsigned a0 = 0; a0 < map->width; a0 += BakeTileSize)
+            {
+                for(unsigned b0 = 0; b0 < map->height; b0 += BakeTileSize)
+                {
+                    unsigned t = map->firsttile + a0 / BakeTileSize * LightmapTileSpan(map->height) + b0 / BakeTileSize;
+                    unsigned covered = 0;
+                    for(unsigned a = a0; a < min(a0 + BakeTileSize, map->width); ++a)
+                    {
+                        for(unsigned b = b0; b < min(b0 + BakeTileSize, map->height); ++b)
+                        {
+                            covered += map->coverage[a * map->height + b];
+                        }
+                    }
+
+                    const unsigned char* sources = TileSources + (size_t)t * TileSourceBytes;
+                    int converged = TileChanges[t] < TileConvergence * covered;
+                    for(unsigned k = 0; converged && k < TileSourceBytes; ++k)
+                    {
+                        converged = !(sources[k] & changed[k]);
+                    }
+
+                    TileSkip[t] = converged;
+                }
+            }
+        }
     }
 
-    close_enough:;
-        // Is the target in this sector?
-        return origin_sectorno == target_sectorno ? 0 : 2;
+    SyncCache(TileSkip, NumBakeTiles);
+    free(changed);
 }
 
-#define narealightcomponents    32
-#define area_light_radius       0.4
-#define nrandomvectors          128
-#define firstround              1
-#define maxrounds               100
-#define fade_distance_diffuse   10.0
-#define fade_distance_radiosity 10.0
-#define radiomul                1.0
+/**************************************** INCREMENTAL BAKE *****************************************/
+/* Each sector's bake is summed up in a hash of everything its lightmaps are baked from: its own   */
+/* geometry and lightmap layout, and each light that can shine on it, along with the geometry that */
+/* light passes on the way. The hashes of the last bake are kept in the texture cache after the    */
+/* lightmaps, so the next bake only redoes the sectors whose hash has changed, and the             */
+/* radiosity of the sectors around them.                                                           */
+/***************************************************************************************************/
 
-static struct vec3d tvec[nrandomvectors];
-static struct vec3d avec[narealightcomponents];
+// What the baked light depends on besides the map: when any of it changes, everything gets baked again.
+static const double BakeSettings[] = { narealightcomponents, area_light_radius, nrandomvectors,
+                                       fade_distance_diffuse, fade_distance_radiosity, radiomul,
+                                       irradiance_spacing, irradiance_error, irradiance_accuracy };
 
-static void DiffuseLightCalculation(struct vec3d normal, struct vec3d tangent, struct vec3d bitangent,
-                                    struct TextureSet* texture, unsigned tx, unsigned ty,
-                                    unsigned lx, unsigned ly,  struct vec3d point_in_wall,
-                                    unsigned sectorno)
+#define MaxReachSteps   100000
+#define MaxReachDepth   64
+
+// SectorHash: Everything of sector n that its lightmaps are baked from, besides the lights.
+static unsigned long long SectorHash(unsigned n)
 {
-    struct vec3d perturbed_normal = PerturbNormal(normal, tangent, bitangent, texture->normalmap[tx][ty]);
+    const struct sector* sect = &sectors[n];
+    unsigned long long hash = HashSeed;
+    hash = HashBytes(hash, &sect->floor, sizeof(sect->floor));
+    hash = HashBytes(hash, &sect->ceil, sizeof(sect->ceil));
+    hash = HashBytes(hash, sect->vertex, sizeof(*sect->vertex) * (sect->nPoints + 1));
+    hash = HashBytes(hash, sect->neighbors, sizeof(*sect->neighbors) * sect->nPoints);
+    hash = HashBytes(hash, &Geometry.hole_low[Geometry.firstwall[n]], sizeof(float) * sect->nPoints);
+    hash = HashBytes(hash, &Geometry.hole_high[Geometry.firstwall[n]], sizeof(float) * sect->nPoints);
+
+    // Where the lightmaps are in the cache. When they move, the light baked for them is not there anymore.
+    for(const struct lightmap* map = sect->floorlightmap; map < sect->lowerlightmaps + sect->nPoints; ++map)
+    {
+        size_t offset = map->texels - Lightmaps[0].texels;
+        hash = HashBytes(hash, &offset, sizeof(offset));
+        hash = HashBytes(hash, &map->width, sizeof(map->width));
+        hash = HashBytes(hash, &map->height, sizeof(map->height));
+    }
 
-    // For each lightsource, check if ther is an obstacle in between this vertex and the lightsource.
-    // Calculate the ambient light levels from the fact.
-    // This simulates diffuse light.
-    struct vec3d color = {0, 0, 0};
-    for(unsigned l=0; l<NumLights; ++l)
+    return hash;
+}
+
+// ClipInterval: Narrow t0..t1 to where the linear function going from f0 at t=0 to f1 at t=1 is not negative.
+static void ClipInterval(float* t0, float* t1, float f0, float f1)
+{
+    if(f0 < 0 && f1 < 0)
     {
-        const struct light* light = &lights[l];
-        struct vec3d source = 
-        { 
-            point_in_wall.x + normal.x * 1e-5f,
-            point_in_wall.y + normal.y * 1e-5f,
-            point_in_wall.z + normal.z * 1e-5f
-        };
+        *t0 = 1;
+        *t1 = 0;
+    }
+    else if(f0 < 0)
+        *t0 = max(*t0, f0 / (f0 - f1));
+    else if(f1 < 0)
+        *t1 = min(*t1, f0 / (f0 - f1));
+}
 
-        for(unsigned qa = 0; qa < narealightcomponents; ++qa)
-        {
-            struct vec3d target  = { light->where.x + avec[qa].x, light->where.y + avec[qa].y, light->where.z + avec[qa].z };
-            struct vec3d towards = { target.x - source.x, target.y - source.y, target.z - source.z };
-            float len = vlen(towards.x, towards.y, towards.z);
-            float invlen = 1.0f / len;
-            
-            towards.x *= invlen;
-            towards.y *= invlen;
-            towards.z *= invlen;
+// SpreadLight: Mark sector n and the sectors behind it that the light at `origin` sees through the portals,
+// seen from above. Unless `full`, it only sees the directions from `left` to `right` (counterclockwise).
+// The portals are widened by the radius of the area light, so that rays from any part of it are included.
+// `entry` is the portal it came in through, which no ray crosses twice. Running out of steps or depth
+// leaves *steps above MaxReachSteps.
+static void SpreadLight(struct vec2d origin, unsigned n, const struct vec2d* entry, struct vec2d left, struct vec2d right,
+                        int full, unsigned depth, unsigned char* reach, unsigned* steps)
+{
+    const struct sector* sect = &sectors[n];
+    reach[n] = 1;
+    if(++*steps > MaxReachSteps || depth > MaxReachDepth)
+    {
+        *steps = MaxReachSteps + 1;
+        return;
+    }
 
-            float cosine = vdot3(perturbed_normal.x, perturbed_normal.y, perturbed_normal.z, towards.x, towards.y, towards.z);
-            float power  = cosine / (1.f + powf(len / fade_distance_diffuse, 2.0f));
-            power /= (float) narealightcomponents;
+    for(unsigned s = 0; s < sect->nPoints; ++s)
+    {
+        unsigned w = Geometry.firstwall[n] + s;
+        if(sect->neighbors[s] < 0 || Geometry.hole_high[w] < Geometry.hole_low[w])
+            continue;
 
-            if(power > 1e-7f)
-            {
-                struct Intersection i;
-                if(IntersectRay(source, sectorno, target, light->sector, &i) == 0)
-                {
-                    color.x += light->light.x * power;
-                    color.y += light->light.y * power;
-                    color.z += light->light.z * power;
-                }
-            }
+        if(entry && sect->vertex[s].x == entry[1].x && sect->vertex[s].y == entry[1].y
+                 && sect->vertex[s+1].x == entry[0].x && sect->vertex[s+1].y == entry[0].y)
+            continue;
+
+        struct vec2d along = { (sect->vertex[s+1].x - sect->vertex[s].x) / Geometry.length[w] * area_light_radius,
+                               (sect->vertex[s+1].y - sect->vertex[s].y) / Geometry.length[w] * area_light_radius };
+        struct vec2d a = { sect->vertex[s].x - along.x - origin.x, sect->vertex[s].y - along.y - origin.y };
+        struct vec2d b = { sect->vertex[s+1].x + along.x - origin.x, sect->vertex[s+1].y + along.y - origin.y };
+
+        float t0 = 0, t1 = 1;
+        if(!full)
+        {
+            ClipInterval(&t0, &t1, vxs(left.x, left.y, a.x, a.y), vxs(left.x, left.y, b.x, b.y));
+            ClipInterval(&t0, &t1, vxs(a.x, a.y, right.x, right.y), vxs(b.x, b.y, right.x, right.y));
+            if(t0 > t1)
+                continue;
         }
-    }
 
-    PutColor(&texture->lightmap[lx][ly], color);
+        struct vec2d from = { a.x + (b.x - a.x) * t0, a.y + (b.y - a.y) * t0 };
+        struct vec2d to   = { a.x + (b.x - a.x) * t1, a.y + (b.y - a.y) * t1 };
+        float turn = vxs(from.x, from.y, to.x, to.y);
+
+        // A light right on the line of the portal could see anything behind it.
+        if(fabsf(turn) < 1e-6f)
+            SpreadLight(origin, sect->neighbors[s], &sect->vertex[s], from, to, 1, depth + 1, reach, steps);
+        else if(turn > 0)
+            SpreadLight(origin, sect->neighbors[s], &sect->vertex[s], from, to, 0, depth + 1, reach, steps);
+        else
+            SpreadLight(origin, sect->neighbors[s], &sect->vertex[s], to, from, 0, depth + 1, reach, steps);
+    }
 }
 
-static void RadiosityCalculation(struct vec3d normal, struct vec3d tangent, struct vec3d bitangent,
-                                 struct TextureSet* texture, unsigned tx, unsigned ty,
-                                 unsigned lx, unsigned ly, struct vec3d point_in_wall,
-                                 unsigned sectorno)
+// LightReach: Mark the sectors that light l can shine on. If the portals get too many to follow,
+// it settles for all sectors that there is any way to. A light in no known sector reaches none: the rays
+// to it never get to its sector.
+static void LightReach(unsigned l, unsigned char* reach)
 {
-    struct vec3d perturbed_normal = PerturbNormal(normal, tangent, bitangent, texture->normalmap[tx][ty]);
+    unsigned steps = 0;
+    struct vec2d origin = { lights[l].where.x, lights[l].where.z };
+    memset(reach, 0, NumSectors);
+    if(lights[l].sector >= NumSectors)
+        return;
 
-    // Shoot rays to each random direction and see what it hits.
-    // Take the last round's light value from that location.
-    struct vec3d source = 
+    SpreadLight(origin, lights[l].sector, NULL, origin, origin, 1, 0, reach, &steps);
+
+    if(steps > MaxReachSteps)
     {
-        point_in_wall.x + normal.x * 1e-3f,
-        point_in_wall.y + normal.y * 1e-3f,
-        point_in_wall.z + normal.z * 1e-3f
-    };
+        unsigned* depth = malloc(sizeof(unsigned) * NumSectors);
+        PortalDepths(lights[l].sector, depth);
+        for(unsigned n = 0; n < NumSectors; ++n)
+        {
+            reach[n] = depth[n] < NumSectors;
+        }
 
-    float basepower = radiomul / nrandomvectors;
+        free(depth);
+    }
+}
 
-    // Apply the set of random vectors to this surface.
-    // This produces a set of vectors all pointing away
-    // from the wall to random directions.
-    struct vec3d color = { 0, 0, 0 };
-    for(unsigned qq = 0; qq < nrandomvectors; ++qq)
+// BuildSectorLights: List the lights that can shine on each sector. Lights too far away to matter are left
+// out too: the most a light can add to a texel is bounded by its distance from the sector's box, and the
+// weakest ones are dropped for as long as all of the dropped ones together stay below half a step of light.
+// That is before PutColor() clamps and truncates, so a texel may still come out a step darker.
+static void BuildSectorLights(void)
+{
+    unsigned char* reach = malloc(NumSectors * max(NumLights, 1u));
+    float* bound = malloc(sizeof(float) * max(NumLights, 1u));
+    unsigned pairs = 0, culled = 0;
+
+    for(unsigned l = 0; l < NumLights; ++l)
+    {
+        LightReach(l, reach + l * NumSectors);
+    }
+
+    SectorLightStart = realloc(SectorLightStart, sizeof(unsigned) * (NumSectors + 1));
+    SectorLightList  = realloc(SectorLightList, sizeof(unsigned) * max(NumSectors * NumLights, 1u));
+    for(unsigned n = 0; n < NumSectors; ++n)
     {
-        struct vec3d rvec = tvec[qq];
+        const struct sector* sect = &sectors[n];
+        float dropped = 0;
+        SectorLightStart[n] = pairs;
 
-        // If the random vector points to the wrong side from the wall, flip it
-        if(vdot3(rvec.x, rvec.y, rvec.z, normal.x, normal.y, normal.z) < 0)
+        for(unsigned l = 0; l < NumLights; ++l)
         {
-            rvec.x = -rvec.x;
-            rvec.y = -rvec.y;
-            rvec.z = -rvec.z;
+            const struct light* light = &lights[l];
+            float dx = max(max(Geometry.bounding_min[n].x - light->where.x, light->where.x - Geometry.bounding_max[n].x), 0);
+            float dy = max(max(sect->floor - light->where.y, light->where.y - sect->ceil), 0);
+            float dz = max(max(Geometry.bounding_min[n].y - light->where.z, light->where.z - Geometry.bounding_max[n].y), 0);
+            float distance = max(vlen(dx, dy, dz) - area_light_radius, 0);
+            bound[l] = max(max(light->light.x, light->light.y), light->light.z) / (1.f + powf(distance / fade_distance_diffuse, 2.0f));
         }
 
-        struct vec3d target =
+        for(;;)
         {
-            source.x + rvec.x * 512.f,
-            source.y + rvec.y * 512.f,
-            source.z + rvec.z * 512.f
-        };
+            int weakest = -1;
+            for(unsigned l = 0; l < NumLights; ++l)
+            {
+                if(reach[l * NumSectors + n] && (weakest < 0 || bound[l] < bound[weakest]))
+                    weakest = l;
+            }
 
-        struct Intersection i;
-        if(IntersectRay(source, sectorno, target, -1, &i) == 1)
-        {
-            float cosine = vdot3(perturbed_normal.x, i.normal.x,
-                                 perturbed_normal.y, i.normal.y,
-                                 perturbed_normal.z, i.normal.z) * basepower;
+            if(weakest < 0 || dropped + bound[weakest] >= 0.5f)
+                break;
 
-            float len = vlen(i.where.x - source.x, i.where.y - source.y, i.where.z - source.z);
-            float power = abs(cosine) / (1.f + powf(len / fade_distance_radiosity, 2.0f));
+            dropped += bound[weakest];
+            reach[weakest * NumSectors + n] = 0;
+            ++culled;
+        }
 
-            color.x += ((i.sample >> 16) & 0xFF) * power;
-            color.y += ((i.sample >>  8) & 0xFF) * power;
-            color.z += ((i.sample >>  0) & 0xFF) * power;
+        for(unsigned l = 0; l < NumLights; ++l)
+        {
+            if(reach[l * NumSectors + n])
+                SectorLightList[pairs++] = l;
         }
     }
 
-    AddColor(&texture->lightmap[lx][ly], color);
+    SectorLightStart[NumSectors] = pairs;
+    fprintf(stderr, "- %.1f of %u lights shine on a sector on the average, %u more were too faint to matter\n",
+            pairs / (double)max(NumSectors, 1u), NumLights, culled);
+    free(bound);
+    free(reach);
 }
 
-static void Begin_Radiosity(struct TextureSet* set)
+// SectorBakeHashes: Hash everything the lightmaps of each sector are baked from: the settings, the sector,
+// and each light that reaches it, along with every sector that light reaches.
+static void SectorBakeHashes(unsigned long long* hashes)
 {
-    memcpy(&set->lightmap, &set->lightmap_diffuseonly, sizeof(Texture));
-}
+    unsigned long long* sectorhashes = malloc(sizeof(unsigned long long) * NumSectors);
+    unsigned char* reach = malloc(NumSectors * max(NumLights, 1u));
+    unsigned long long settings = HashBytes(HashSeed, BakeSettings, sizeof(BakeSettings));
 
-static double End_Radiosity(struct TextureSet* set, const char* label)
-{
-    long differences = 0;
-    for(unsigned x=0; x < 1024; ++x)
+    for(unsigned n = 0; n < NumSectors; ++n)
     {
-        for(unsigned y = 0; y < 1024; ++y)
-        {
-            int old = set->lightmap_diffuseonly[x][y];
-            int r = (old >> 16) & 0xFF;
-            int g = (old >>  8) & 0xFF;
-            int b = (old) & 0xFF;
+        sectorhashes[n] = SectorHash(n);
+        hashes[n] = HashBytes(settings, &sectorhashes[n], sizeof(sectorhashes[n]));
+    }
 
-            int new = set->lightmap[x][y];
-            r -= (new >> 16) & 0xFF;
-            g -= (new >>  8) & 0xFF;
-            b -= (new) & 0xFF;
+    for(unsigned l = 0; l < NumLights; ++l)
+    {
+        unsigned char* lightreach = reach + l * NumSectors;
+        LightReach(l, lightreach);
+
+        unsigned long long lighthash = HashSeed;
+        lighthash = HashBytes(lighthash, &lights[l].where, sizeof(lights[l].where));
+        lighthash = HashBytes(lighthash, &lights[l].light, sizeof(lights[l].light));
+        lighthash = HashBytes(lighthash, &lights[l].sector, sizeof(lights[l].sector));
+        for(unsigned n = 0; n < NumSectors; ++n)
+        {
+            if(lightreach[n])
+                lighthash = HashBytes(lighthash, &sectorhashes[n], sizeof(sectorhashes[n]));
+        }
 
-            differences += abs(r) + abs(g) + abs(b);
+        for(unsigned n = 0; n < NumSectors; ++n)
+        {
+            if(lightreach[n])
+                hashes[n] = HashBytes(hashes[n], &lighthash, sizeof(lighthash));
         }
     }
 
-    double result = differences / (double)(1024 * 1024);
-    fprintf(stderr, "Differences in %s: %g\33[K\n", label, result);
-    return result;
+    free(reach);
+    free(sectorhashes);
+}
+
+// DirtySectors: Mark the sectors whose lightmaps were baked from something else than what there is now.
+// Returns their number.
+static unsigned DirtySectors(const unsigned long long* hashes, unsigned char* dirty)
+{
+    unsigned count = 0;
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        dirty[n] = hashes[n] != BakedSectorHashes[n];
+        count += dirty[n];
+    }
+
+    return count;
 }
 
-static void End_Diffuse(struct TextureSet* set)
+// CountDirtySectors: Number of sectors whose lightmaps need baking.
+static unsigned CountDirtySectors(void)
 {
-    memcpy(&set->lightmap_diffuseonly, &set->lightmap, sizeof(Texture));
+    unsigned long long* hashes = malloc(sizeof(unsigned long long) * NumSectors);
+    unsigned char* dirty = malloc(NumSectors);
+    SectorBakeHashes(hashes);
+    unsigned count = DirtySectors(hashes, dirty);
+    free(dirty);
+    free(hashes);
+    return count;
 }
 
-#ifdef _OPENMP
-#include <omp.h>
+// RadiosityNeighbours: Add to `bake` the sectors that bounce light onto the sectors in it, or get it from them:
+// those there is a way to through the portals, without going further than the radiosity fades from them.
+static void RadiosityNeighbours(unsigned char* bake)
+{
+    unsigned* queue = malloc(sizeof(unsigned) * NumSectors);
+    unsigned char* dirty = malloc(NumSectors);
+    memcpy(dirty, bake, NumSectors);
 
-#define OMP_SCALER_LOOP_BEGIN(a,b,c,d,e,f) do { \
-        int this_thread = omp_get_thread_num(), num_threads = omp_get_num_threads(); \
-        int my_start = (this_thread  ) * ((c)-(a)) / num_threads + (a); \
-        int my_end   = (this_thread+1) * ((c)-(a)) / num_threads + (a); \
-        struct Scaler e##int = Scaler_Init(a, my_start, (c)-1, (d) * 32768, (f) * 32768); \
-        for(int b = my_start; b < my_end; ++b) \
-        { \
-            float e = Scaler_Next(&e##int) / 32768.f;
+    for(unsigned from = 0; from < NumSectors; ++from)
+    {
+        if(!dirty[from])
+            continue;
 
-#else
-#define OMP_SCALER_LOOP_BEGIN(a,b,c,d,e,f) do { \
-        struct Scaler e##int = Scaler_Init(a, a ,(c)-1, (d)*32768, (f)*32768); \
-        for(int b = (a); b < (c); ++b) \
-        {\
-            float e = Scaler_Next(&e##int) / 32768.f; 
-#endif
+        unsigned char* seen = malloc(NumSectors);
+        unsigned head = 0, tail = 0;
+        memset(seen, 0, NumSectors);
+        seen[from] = 1;
+        queue[tail++] = from;
+        while(head < tail)
+        {
+            const struct sector* sect = &sectors[queue[head++]];
+            for(unsigned s = 0; s < sect->nPoints; ++s)
+            {
+                int neighbor = sect->neighbors[s];
+                if(neighbor < 0 || seen[neighbor])
+                    continue;
+
+                seen[neighbor] = 1;
+                struct vec2d gap = { max(max(Geometry.bounding_min[neighbor].x - Geometry.bounding_max[from].x,
+                                             Geometry.bounding_min[from].x - Geometry.bounding_max[neighbor].x), 0),
+                                     max(max(Geometry.bounding_min[neighbor].y - Geometry.bounding_max[from].y,
+                                             Geometry.bounding_min[from].y - Geometry.bounding_max[neighbor].y), 0) };
+                if(gap.x * gap.x + gap.y * gap.y > fade_distance_radiosity * fade_distance_radiosity)
+                    continue;
+
+                bake[neighbor] = 1;
+                queue[tail++] = neighbor;
+            }
+        }
+
+        free(seen);
+    }
 
-#define OMP_SCALER_LOOP_END() \
-        } \
-    } while(0)
+    free(dirty);
+    free(queue);
+}
 
+// StartBakeRound: Note in the journal that the bake is at the start of this round.
+static void StartBakeRound(unsigned round)
+{
+    BakeJournal->random = BakeRandomState;
+    BakeJournal->differences = 0;
+    memset(BakeJournalSurfaces, SurfaceWaiting, NumLightmaps);
+    SyncCache(BakeJournalSurfaces, NumLightmaps);
+    BakeJournal->round = round;
+    SyncCache(BakeJournal, sizeof(*BakeJournal));
+}
 
-// Lightmap calculation involes some raytracing.
-static void BuildLightmaps(void)
+// Lightmap calculation involes some raytracing. Unless `everything`, only the sectors that have changed
+// since the last bake are baked. With `resume`, an interrupted bake goes on from where the journal says it was.
+static void BuildLightmaps(int everything, int resume)
 {
-    for(unsigned round = firstround; round<=maxrounds; ++round)
+    unsigned long long* hashes = malloc(sizeof(unsigned long long) * NumSectors);
+    unsigned char* neighbourhood = malloc(NumSectors);
+    SectorBakeHashes(hashes);
+
+    if(resume && BakeJournal->round == 0)
     {
-        fprintf(stderr, "Lighting calculation, round %u...\n", round);
-#ifndef _OPENMP
-    fprintf(stderr, "Note: This would probably go faster if you enabled OpenMP in your compiler options. It's -fopenmp in GCC and Clang. \n");
-#endif
+        fprintf(stderr, "There is no interrupted bake to resume.\n");
+        resume = 0;
+    }
 
-        // Create unformly distributed random unit vectors
-        for(unsigned n = 0; n < nrandomvectors; ++n)
+    for(unsigned n = 0; resume && n < NumSectors; ++n)
+    {
+        if(BakeJournalSectors[n] && BakeJournalHashes[n] != hashes[n])
         {
-            double u = (rand() % 1000000) / 1e6;
-            double v = (rand() % 1000000) / 1e6;
-            double theta = 2*3.141592653 * u;
-            double phi = acos(2*v-1);
-            tvec[n].x = cos(theta) * sin(phi);
-            tvec[n].y = sin(theta) * sin(phi);
-            tvec[n].z = cos(phi);
+            fprintf(stderr, "The map has changed since the bake was interrupted. Starting over.\n");
+            resume = 0;
         }
+    }
 
-        //  A lightsource is represented by a spherical cloud of smaller lightsources around the actual lightsource.
-        // The achieves smooth edges for the shadows.
-        #define drand(m) ((rand()%1000-500)*5e-2*m)
-        for(unsigned qa=0; qa < narealightcomponents; ++qa)
+    if(resume)
+    {
+        unsigned count = 0;
+        for(unsigned n = 0; n < NumSectors; ++n)
         {
-            double len;
-            do{
-                avec[qa] = (struct vec3d){ drand(100.0), drand(100.0), drand(100.0) };
-                len = sqrt(avec[qa].x * avec[qa].x + avec[qa].y * avec[qa].y + avec[qa].z * avec[qa].z);
-            } while(len < 1e-3);
-
-            avec[qa].x *= area_light_radius / len;
-            avec[qa].y *= area_light_radius / len;
-            avec[qa].z *= area_light_radius / len;
+            count += BakeJournalSectors[n];
         }
-        
-        #undef drand
 
-        fprintf(stderr, "Note: You can interrupt this program at any time you want. If you wish to resume\n"
-                        "      the lightmap calculation at a later date, use the --rebuild commandline option.\n"
-                        "      If you have already finished round 1 (diffuse light), and don't wish to do that\n"
-                        "      again, change the '#define firstround' value to your liking. Value 1 means\n"
-                        "      it starts from beginning, and any value from 2-100 (actual value is not important)\n"
-                        "      means to progressively improve the radiosity (cumulative). The current value is %d.\n",
-            firstround);
+        if(BakeJournal->round > maxrounds)
+            fprintf(stderr, "Resuming the bake of %u sectors out of %u after round %u.\n", count, NumSectors, BakeJournal->last);
+        else
+            fprintf(stderr, "Resuming the bake of %u sectors out of %u in round %u.\n", count, NumSectors, BakeJournal->round);
+    }
+    else
+    {
+        if(BakeJournal->round != 0)
+            fprintf(stderr, "Note: Starting the bake over. --resume would go on with the one that was interrupted.\n");
 
-        double total_differences = 0;
-        for(unsigned sectorno = 0; sectorno < NumSectors; ++sectorno)
+        unsigned count = DirtySectors(hashes, BakeJournalSectors);
+        if(everything)
         {
-            struct sector* const sect = &sectors[sectorno];
-            const struct vec2d* const vert = sect->vertex;
-
-            double sector_differences = 0;
-
-            if(1) // do ceiling and floor
-            {
-                struct vec2d bounding_min = { 1e9f, 1e9f };
-                struct vec2d bounding_max = { -1e9f, -1e9f };
-
-                GetSectorBoundingBox(sectorno, &bounding_min, &bounding_max);
-                struct vec3d floornormal    = (struct vec3d){0, 1, 0}; // floor
-                struct vec3d floortangent   = (struct vec3d){1, 0, 0};
-                struct vec3d floorbitangent = vxs3(floornormal.x, floornormal.y, floornormal.z, floortangent.x, floortangent.y, floortangent.z);
-                struct vec3d ceilnormal     = (struct vec3d){0, -1, 0}; // ceiling
-                struct vec3d ceiltangent    = (struct vec3d){1, 0, 0};
-                struct vec3d ceilbitangent  = vxs3(ceilnormal.x, ceilnormal.y, ceilnormal.z, ceiltangent.x, ceiltangent.y, ceiltangent.z);
-
-                fprintf(stderr, "Bounding box for sector %d/%d: %g,%g - %g,%g\n", sectorno+1, NumSectors, bounding_min.x, 
-                        bounding_min.y, bounding_max.x, bounding_max.y);
-
-                // Round 1: Check lightsources
-                if(round == 1)
-                {
-                    struct Scaler txtx_int = Scaler_Init(0,0,1023, bounding_min.x*32768, bounding_max.x*32768);
-                    for(unsigned x = 0; x < 1024; ++x)
-                    {
-                        fprintf(stderr, "- Sector %d ceil&floor, %u/%u diffuse light...\r", sectorno+1, x, 1024);
-                        float txtx = Scaler_Next(&txtx_int) / 32768.f;
-
-                        // For better cache locality, fist, do floors and then ceils
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0, y, 1024, bounding_min.y, txty, bounding_max.y);
-                            DiffuseLightCalculation(floornormal, floortangent, floorbitangent, sect->floortexture, ((unsigned)(txtx*256)) % 1024,
-                            ((unsigned)(txty*256)) % 1024, x, y, (struct vec3d){txtx, sect->floor, txty}, sectorno);
-                        OMP_SCALER_LOOP_END();
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0, y, 1024, bounding_min.y, txty, bounding_max.y);
-                            DiffuseLightCalculation(ceilnormal, ceiltangent, ceilbitangent, sect->ceiltexture, ((unsigned)(txtx*256)) % 1024,
-                            ((unsigned)(txty*256)) % 1024, x, y, (struct vec3d){txtx, sect->ceil, txty}, sectorno);
-                        OMP_SCALER_LOOP_END();
-                    }
+            memset(BakeJournalSectors, 1, NumSectors);
+            count = NumSectors;
+        }
 
-                    fprintf(stderr, "\n");
-                    End_Diffuse(sect->floortexture);
-                    End_Diffuse(sect->ceiltexture);
-                }
-                else
-                {
-                    // Round 2+: Radiosity
-                    Begin_Radiosity(sect->floortexture);
-                    Begin_Radiosity(sect->ceiltexture);
+        if(count == 0)
+        {
+            fprintf(stderr, "Lightmaps are up to date.\n");
+            free(neighbourhood);
+            free(hashes);
+            return;
+        }
 
-                    // Calculate radiosity in decreased resolution
-                    struct Scaler txtx_int = Scaler_Init(0,0,1023, bounding_min.x*32768, bounding_max.x*32768);
-                    for(unsigned x = 0; x < 1024; ++x)
-                    {
-                        fprintf(stderr, "- Sector %d ceil&floor, %u/%u radiosity...\r", sectorno+1, x, 1024);
-                        float txtx = Scaler_Next(&txtx_int) / 32768.f;
-
-                        // For better cache locality, fist, do floors and then ceils
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0, y, 1024, bounding_min.y, txty, bounding_max.y);
-                            RadiosityCalculation(floornormal, floortangent, floorbitangent, sect->floortexture, ((unsigned)(txtx*256)) % 1024,
-                            ((unsigned)(txty*256)) % 1024, x, y, (struct vec3d){txtx, sect->floor, txty}, sectorno);
-                        OMP_SCALER_LOOP_END();
-                        #pragma omp parallel
-                        OMP_SCALER_LOOP_BEGIN(0, y, 1024, bounding_min.y, txty, bounding_max.y);
-                            RadiosityCalculation(ceilnormal, ceiltangent, ceilbitangent, sect->ceiltexture, ((unsigned)(txtx*256)) % 1024,
-                            ((unsigned)(txty*256)) % 1024, x, y, (struct vec3d){txtx, sect->ceil, txty}, sectorno);
-                        OMP_SCALER_LOOP_END();
-                    }
+        fprintf(stderr, "Baking the lightmaps of %u sectors out of %u.\n", count, NumSectors);
 
-                    char Buf[128];
-                    sprintf(Buf, "Sector %u floors", sectorno + 1);
-                    sector_differences += End_Radiosity(sect->floortexture, Buf);
-                    sprintf(Buf, "Sector %u ceils", sectorno + 1);
-                    sector_differences += End_Radiosity(sect->ceiltexture, Buf);
-                }
-            }
+        // Until the bake is done, the lightmaps of these sectors are not baked from anything.
+        for(unsigned n = 0; n < NumSectors; ++n)
+        {
+            if(BakeJournalSectors[n])
+                BakedSectorHashes[n] = 0;
+        }
 
-            if(1)
-            {
-                for(unsigned s=0; s < sect->nPoints; ++s)
-                {
-                    float xd = vert[s+1].x - vert[s].x;
-                    float zd = vert[s+1].y - vert[s].y;
-                    float len = vlen(xd, zd, 0);
+        SyncCache(BakedSectorHashes, sizeof(unsigned long long) * NumSectors);
+        memcpy(BakeJournalHashes, hashes, sizeof(unsigned long long) * NumSectors);
+        SyncCache(BakeJournalHashes, sizeof(unsigned long long) * NumSectors);
+        SyncCache(BakeJournalSectors, NumSectors);
+        memset(TileSkip, 0, NumBakeTiles);
+        SyncCache(TileSkip, NumBakeTiles);
+        BakeRandomState = BakeRandomSeed;
+        BakeJournal->first = firstround;
+        BakeJournal->last = firstround - 1;
+        StartBakeRound(firstround);
+    }
 
-                    struct vec3d normal     = { -zd/len, 0, xd/len};
-                    struct vec3d tangent    = {xd/len, 0, zd/len};
-                    struct vec3d bitangent  = {0, 1, 0};
+    free(hashes);
+    if(!MapNormalMaps())
+    {
+        fprintf(stderr, "The bake needs the normal maps. Run again with --resume to go on with it.\n");
+        free(neighbourhood);
+        return;
+    }
 
-                    float hole_low  = 9e9;
-                    float hole_high = -9e9;
+    memcpy(neighbourhood, BakeJournalSectors, NumSectors);
+    RadiosityNeighbours(neighbourhood);
+    BuildSectorLights();
 
-                    if(sect->neighbors[s] >= 0)
-                    {
-                        hole_low  = max(sect->floor, sectors[sect->neighbors[s]].floor);
-                        hole_high = min(sect->ceil, sectors[sect->neighbors[s]].ceil);
-                    }
+    for(unsigned round = BakeJournal->round; round<=maxrounds; ++round)
+    {
+        fprintf(stderr, "Lighting calculation, round %u...\n", round);
+#ifndef _OPENMP
+    fprintf(stderr, "Note: This would probably go faster if you enabled OpenMP in your compiler options. It's -fopenmp in GCC and Clang. \n");
+#endif
 
-                    if(round == 1)
-                    {
-                        // Round 1: Check lightsources
-                        struct Scaler txtx_int = Scaler_Init(0,0,1023, vert[s].x*32768, vert[s+1].x*32768);
-                        struct Scaler txtz_int = Scaler_Init(0,0,1023, vert[s].y*32768, vert[s+1].y*32768);
+        // Where this round's sample points start from
+        BakeRandomState = BakeJournal->random;
+        RoundSampleOffset = (struct vec2d) { (BakeRandom() % 1000000) / 1e6f, (BakeRandom() % 1000000) / 1e6f };
+        HammersleyPoints(AreaLightPoints, narealightcomponents);
+        HammersleyPoints(HemispherePoints, nrandomvectors);
+
+        fprintf(stderr, "Note: You can interrupt this program at any time you want. To go on with the lightmap\n"
+                        "      calculation at a later date, run it again with the --resume commandline option.\n"
+                        "      Once it is done, only the sectors whose geometry or lights change are baked again\n"
+                        "      (--bake in the benchmark; the game does it by itself).\n");
+
+        // Radiosity changes around the changed sectors too. It reads the light of the last round of this bake, and
+        // the light of the texels elsewhere.
+        const unsigned char* bake = round == 1 ? BakeJournalSectors : neighbourhood;
+        if(round > 1)
+        {
+            LoadRadiosityPlanes(round, round > 2 && round > BakeJournal->first ? neighbourhood : NULL);
+            RadiosityPlane = (round + 1) % 2;
+        }
 
-                        for(unsigned x=0; x < 1024; ++x)
-                        {
-                            float txtx = Scaler_Next(&txtx_int) / 32768.f;
-                            float txtz = Scaler_Next(&txtz_int) / 32768.f;
-
-                            fprintf(stderr, "- Sector %u Wall %u/%u %u/%u diffuse light...\r", sectorno+1, s+1, sect->nPoints, x, 1024);
-                            #pragma omp parallel
-                            OMP_SCALER_LOOP_BEGIN(0,y,1024, sect->ceil, txty, sect->floor);
-                                struct TextureSet* texture = &sect->uppertextures[s];
-
-                                if(sect->neighbors[s] >= 0 && txty < hole_high)
-                                {
-                                    if(txty > hole_low)
-                                        continue;
-                                    texture = &sect->lowertextures[s];
-                                }
-
-                                struct vec3d point_in_wall = { txtx, txty, txtz };
-                                DiffuseLightCalculation(normal, tangent, bitangent, texture, x, y, x, y, point_in_wall, sectorno);
-                            OMP_SCALER_LOOP_END();
-                        }
+        BakeRound(round, bake);
 
-                        End_Diffuse(&sect->uppertextures[s]);
-                        End_Diffuse(&sect->lowertextures[s]);
-                    }
-                    else
-                    {
-                        Begin_Radiosity(&sect->uppertextures[s]);
-                        Begin_Radiosity(&sect->lowertextures[s]);
+        // Finish the surfaces: fill in the texels off them and make the mip levels.
+        for(unsigned sectorno = 0; sectorno < NumSectors; ++sectorno)
+        {
+            if(!bake[sectorno])
+                continue;
 
-                        // Round 2+: Radiosity 
-                        struct Scaler txtx_int = Scaler_Init(0,0,1023, vert[s].x*32768, vert[s+1].x*32768);
-                        struct Scaler txtz_int = Scaler_Init(0,0,1023, vert[s].y*32768, vert[s+1].y*32768);
-                        for(unsigned x=0; x < 1024; ++x)
-                        {
-                            float txtx = Scaler_Next(&txtx_int) / 32768.f;
-                            float txtz = Scaler_Next(&txtz_int) / 32768.f;
-
-                            fprintf(stderr, "- Sector %u Wall %u/%u %u/%u radiosity...\r", sectorno+1, s+1, sect->nPoints, x, 1024);
-                            #pragma omp parallel
-                            OMP_SCALER_LOOP_BEGIN(0,y,1024, sect->ceil, txty, sect->floor);
-                                struct TextureSet* texture = &sect->uppertextures[s];
-
-                                if(sect->neighbors[s] >= 0 && txty < hole_high)
-                                {
-                                    if(txty > hole_low)
-                                        continue;
-                                    texture = &sect->lowertextures[s];
-                                }
-
-                                struct vec3d point_in_wall = { txtx, txty, txtz };
-                                RadiosityCalculation(normal, tangent, bitangent, texture, x, y, x, y, point_in_wall, sectorno);
-                            OMP_SCALER_LOOP_END();
-                        }
+            struct sector* const sect = &sectors[sectorno];
+            double sector_differences = 0;
+            char label[128];
 
-                        char Buf[128];
-                        sprintf(Buf, "Sector %u wall %u upper texture", sectorno + 1, s+1);
-                        sector_differences += End_Radiosity(&sect->uppertextures[s], Buf);
-                        sprintf(Buf, "Sector %u wall %u lower texture", sectorno + 1, s+1);
-                        sector_differences += End_Radiosity(&sect->lowertextures[s], Buf);
-                    }
+            sprintf(label, "Sector %u floors", sectorno + 1);
+            sector_differences += FinishLightmap(sect->floorlightmap, round, label);
+            sprintf(label, "Sector %u ceils", sectorno + 1);
+            sector_differences += FinishLightmap(sect->ceillightmap, round, label);
 
-                    fprintf(stderr, "\n");
-                }
+            for(unsigned s=0; s < sect->nPoints; ++s)
+            {
+                sprintf(label, "Sector %u wall %u upper texture", sectorno + 1, s+1);
+                sector_differences += FinishLightmap(&sect->upperlightmaps[s], round, label);
+                sprintf(label, "Sector %u wall %u lower texture", sectorno + 1, s+1);
+                sector_differences += FinishLightmap(&sect->lowerlightmaps[s], round, label);
             }
 
-            fprintf(stderr, "Round %u differences in sector %u: %g\n", round, sectorno+1, sector_differences);
-            total_differences += sector_differences;
+            if(round > 1)
+                fprintf(stderr, "Round %u differences in sector %u: %g\n", round, sectorno+1, sector_differences);
         }
 
+        // Includes the surfaces finished before an interruption.
+        double total_differences = BakeJournal->differences;
         fprintf(stderr, "Round %u differences total: %g.\n", round, total_differences);
-        if(total_differences < 1e-6)
+        if(round > 1)
+            SkipConvergedTiles(bake);
+
+        // Round 1 has no radiosity to compare. Once a radiosity round changes nothing, the journal says there is
+        // no round left, so a bake interrupted from here on only stores the light.
+        int converged = round > 1 && total_differences < 1e-6;
+        BakeJournal->last = round;
+        StartBakeRound(converged ? maxrounds + 1 : round + 1);
+        if(converged)
         {
             break;
         }
     }
+
+    // The texels get the light of the last radiosity round.
+    unsigned last = BakeJournal->last;
+    if(last > 1 && last >= BakeJournal->first)
+    {
+        fprintf(stderr, "Storing the light of round %u in the lightmaps.\n", last);
+        for(unsigned n = 0; n < NumSectors; ++n)
+        {
+            const struct sector* sect = &sectors[n];
+            for(struct lightmap* map = sect->floorlightmap; map < sect->lowerlightmaps + sect->nPoints; ++map)
+            {
+                if(neighbourhood[n] && map->covered > 0)
+                    PackRadiosity(map, last);
+            }
+        }
+    }
+
+    // Without round 1 the diffuse light is still what it was baked from before.
+    if(BakeJournal->first <= 1)
+    {
+        for(unsigned n = 0; n < NumSectors; ++n)
+        {
+            if(BakeJournalSectors[n])
+                BakedSectorHashes[n] = BakeJournalHashes[n];
+        }
+
+        SyncCache(BakedSectorHashes, sizeof(unsigned long long) * NumSectors);
+    }
+
+    BakeJournal->round = 0;
+    SyncCache(BakeJournal, sizeof(*BakeJournal));
+    free(neighbourhood);
+    free(SectorLightList);
+    free(SectorLightStart);
+    SectorLightList = NULL;
+    SectorLightStart = NULL;
+    UnmapNormalMaps();
 }
 #endif
 #endif
@@ -1435,7 +3823,7 @@ static void DrawMap(void)
     ++process;
 
     // Render the 2d map on screen
-    SDL_LockSurface(surface);
+    LockSurface(surface);
 #if SplitScreen
     for(unsigned y = 0; y < H; ++y)
         memset((char*)surface->pixels + (y*W2+W)*4, 0, (W2-W)*4);
@@ -1564,7 +3952,7 @@ static void DrawMap(void)
 
     BloomPostprocess();
 
-    SDL_UnlockSurface(surface);
+    UnlockSurface(surface);
 }
 
 static int vert_compare(const struct vec2d* a, const struct vec2d* b)
@@ -1731,7 +4119,7 @@ Rescan:
             if(nearest_point == ~0u)
             {
                 fprintf(stderr, " - ERROR: Could not find a vertex to pair with!\n");
-                SDL_Delay(200);
+                Delay(200);
                 continue;
             }
 
@@ -1847,49 +4235,722 @@ static void MovePlayer(float dx, float dy)
         }
     }
 
-    player.where.x += dx;
-    player.where.y += dy;
-    player.angleSin = sinf(player.angle);
-    player.angleCos = cosf(player.angle);
+    player.where.x += dx;
+    player.where.y += dy;
+    player.angleSin = sinf(player.angle);
+    player.angleCos = cosf(player.angle);
+}
+
+#if TextureMapping
+// Memo of the last surface cache lookup, so a wall or plane only goes to the (locked) cache when its level changes.
+struct surfacememo
+{
+    const struct lightmap* map;
+    unsigned level;
+    const struct surfaceblock* block;
+};
+#endif
+
+#if TextureMapping && LightMapping && SurfaceCache
+/****************************************** SURFACE CACHE ******************************************/
+/* Lit texels (ApplyLight of texture and lightmap) of one surface at one mip level, built the      */
+/* first time the surface is drawn at that level. Walls share their texture and lightmap           */
+/* coordinates, so their blocks are laid out like the mip level itself. Floors and ceilings tile   */
+/* the texture over the sector, so their blocks cover the sector's bounding box in texture space.  */
+/* Blocks used in the current frame are never evicted, so pointers stay valid for the whole frame. */
+/***************************************************************************************************/
+
+struct surfaceblock
+{
+    const struct lightmap* map;         // Key: the surface, which its lightmap is unique to
+    unsigned level;                     // Key: mip level
+    unsigned stamp;                     // Frame this block was last used in
+    int origin_a;                       // Floors and ceilings: level texel coordinates of texels[0]
+    int origin_b;
+    int width;                          // Floors and ceilings: size of the block in texels
+    int height;
+    size_t bytes;
+    struct surfaceblock* next;          // Hash chain
+    int texels[];
+};
+
+#define SurfaceCacheBuckets 1024
+
+static struct surfaceblock* SurfaceCacheHash[SurfaceCacheBuckets];
+static size_t SurfaceCacheUsed = 0;
+static unsigned SurfaceCacheFrame = 0;
+static unsigned long SurfaceCacheBuilt = 0, SurfaceCacheEvicted = 0;
+
+static unsigned SurfaceCacheBucket(const struct lightmap* map, unsigned level)
+{
+    return ((unsigned)(map - Lightmaps) * 31 + level) % SurfaceCacheBuckets;
+}
+
+// EvictSurfaces: Free least recently used blocks not used this frame until `bytes` more fit the budget.
+static int EvictSurfaces(size_t bytes)
+{
+    while(SurfaceCacheUsed + bytes > SurfaceCacheBytes)
+    {
+        struct surfaceblock** oldest = NULL;
+        for(unsigned b = 0; b < SurfaceCacheBuckets; ++b)
+        {
+            for(struct surfaceblock** block = &SurfaceCacheHash[b]; *block; block = &(*block)->next)
+            {
+                if((*block)->stamp != SurfaceCacheFrame && (!oldest || (*block)->stamp < (*oldest)->stamp))
+                {
+                    oldest = block;
+                }
+            }
+        }
+
+        if(!oldest)
+            return 0;
+
+        struct surfaceblock* victim = *oldest;
+        *oldest = victim->next;
+        SurfaceCacheUsed -= victim->bytes;
+        ++SurfaceCacheEvicted;
+        free(victim);
+    }
+
+    return 1;
+}
+
+static struct surfaceblock* BuildSurfaceBlock(const struct TextureSet* set, const struct lightmap* map, unsigned level,
+                                              const struct vec2d* bounding_min, const struct vec2d* bounding_max)
+{
+    int size = 1024 >> level;
+    int origin_a = 0, origin_b = 0, width = size, height = size;
+
+    if(bounding_min)
+    {
+        // Texture texels 256 per map unit, one texel of margin for rounding at the sector edges.
+        origin_a = ((int)floorf(bounding_min->x * 256) >> level) - 1;
+        origin_b = ((int)floorf(bounding_min->y * 256) >> level) - 1;
+        width    = ((int)floorf(bounding_max->x * 256) >> level) + 2 - origin_a;
+        height   = ((int)floorf(bounding_max->y * 256) >> level) + 2 - origin_b;
+    }
+
+    if((long)width * height > MaxSurfaceBlock)
+        return NULL;
+
+    size_t bytes = sizeof(struct surfaceblock) + sizeof(int) * width * height;
+    if(!EvictSurfaces(bytes))
+        return NULL;
+
+    struct surfaceblock* block = malloc(bytes);
+    if(!block)
+        return NULL;
+
+    *block = (struct surfaceblock) { map, level, SurfaceCacheFrame, origin_a, origin_b, width, height, bytes, NULL };
+
+    // Sample the lightmap at the center of each block texel, at the mip level matching the texel size.
+    float texelsize = (1 << level) / (bounding_min ? 256.f : 1.f);
+    unsigned llevel = MipLevel(texelsize * max(map->scale_u, map->scale_v));
+
+    if(!bounding_min)
+    {
+        // Walls: the texture level as it is, lit texel by texel.
+        int* light = malloc(sizeof(int) * size * size);
+        for(int a = 0; a < size; ++a)
+        {
+            for(int b = 0; b < size; ++b)
+            {
+                light[TexelIndexLevel(level, a, b)] = LightmapTexelAt(map, llevel, (a + 0.5f) * texelsize, (b + 0.5f) * texelsize);
+            }
+        }
+        ApplyLightRow(block->texels, set->texture + MipOffset(level), light, size * size);
+        free(light);
+    }
+    else
+    {
+        // Floors and ceilings: the texture repeats, the lightmap stretches over the bounding box.
+        int* texture = malloc(sizeof(int) * height * 2);
+        int* light = texture + height;
+        for(int a = 0; a < width; ++a)
+        {
+            float mapx = (origin_a + a + 0.5f) * texelsize;
+            for(int b = 0; b < height; ++b)
+            {
+                float mapy = (origin_b + b + 0.5f) * texelsize;
+                texture[b] = LevelTexel(set->texture, level, (origin_a + a) & (size - 1), (origin_b + b) & (size - 1));
+                light[b] = LightmapTexelAt(map, llevel, mapx, mapy);
+            }
+            ApplyLightRow(block->texels + a * height, texture, light, height);
+        }
+        free(texture);
+    }
+
+    SurfaceCacheUsed += bytes;
+    ++SurfaceCacheBuilt;
+    return block;
+}
+
+// GetSurfaceBlock: Find or build the lit block of a surface. Walls pass no bounding box.
+// Returns NULL if the block does not fit the cache; the caller then lights texels itself.
+static const struct surfaceblock* GetSurfaceBlock(struct surfacememo* memo, const struct TextureSet* set,
+                                                  const struct lightmap* map, unsigned level,
+                                                  const struct vec2d* bounding_min, const struct vec2d* bounding_max)
+{
+    if(memo->map == map && memo->level == level)
+        return memo->block;
+
+    struct surfaceblock* found = NULL;
+
+    #pragma omp critical(surfacecache)
+    {
+        struct surfaceblock** bucket = &SurfaceCacheHash[SurfaceCacheBucket(map, level)];
+        for(found = *bucket; found && (found->map != map || found->level != level); found = found->next) {}
+
+        if(!found && (found = BuildSurfaceBlock(set, map, level, bounding_min, bounding_max)) != NULL)
+        {
+            found->next = *bucket;
+            *bucket = found;
+        }
+
+        if(found)
+            found->stamp = SurfaceCacheFrame;
+    }
+
+    *memo = (struct surfacememo) { map, level, found };
+    return found;
+}
+#endif
+
+#if TextureMapping && LightMapping && VisibilityTracking && SurfaceStreaming
+/**************************************** SURFACE STREAMING ****************************************/
+/* The texture cache is mapped whole, and the kernel reads each page of it the first time it is    */
+/* touched, in the middle of the frame that first draws the surface. After each frame, the         */
+/* lightmaps and textures of the sectors in view and of those up to StreamLookahead portals away   */
+/* are read ahead with MADV_WILLNEED. When more than StreamingBudget bytes are resident, the ones  */
+/* that have been out of reach the longest are dropped with MADV_DONTNEED; they are still in the   */
+/* file, so dropping them only costs reading them again.                                           */
+/***************************************************************************************************/
+
+struct streamregion
+{
+    const char* begin;
+    size_t bytes;
+    size_t own;                         // Bytes of the pages that are all its own, which dropping it frees
+    unsigned reached;                   // Frame it was last within reach
+    unsigned drawn;                     // Frame it was last drawn in
+    int resident;                       // Read ahead or drawn, and not dropped since
+};
+
+// The mip chain of each lightmap, in the order of Lightmaps, then the texture of each texture set.
+static struct streamregion* StreamRegions = NULL;
+static unsigned NumStreamRegions = 0, StreamFrame = 0;
+static size_t StreamResident = 0;         // Own pages of the resident regions; the ones they share are not dropped
+static unsigned long StreamReadAhead = 0, StreamDropped = 0, StreamPredicted = 0, StreamUnpredicted = 0;
+
+// RegionPages: Where the pages of a region start, and how many bytes they span: all the pages it touches, or
+// only the ones that are all its own, as the lightmaps of other surfaces may share the ones at its ends.
+static size_t RegionPages(const struct streamregion* region, int own, size_t* begin)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t first = (size_t)region->begin, end = first + region->bytes;
+    first = (own ? first + page - 1 : first) / page * page;
+    end = (own ? end : end + page - 1) / page * page;
+    *begin = first;
+    return end > first ? end - first : 0;
+}
+
+// AdviseRegion: madvise() the pages of a region. Read ahead all the pages it touches, but drop only its own.
+static void AdviseRegion(const struct streamregion* region, int advice)
+{
+    size_t begin, bytes = RegionPages(region, advice == MADV_DONTNEED, &begin);
+    if(bytes > 0 && madvise((void*)begin, bytes, advice) != 0)
+        perror("madvise");
+}
+
+// InitStreaming: Set up the regions after the texture cache is mapped, and drop them all, so that streaming
+// starts from nothing resident whatever the baker touched.
+static void InitStreaming(void)
+{
+    NumStreamRegions = NumLightmaps + NumTextureSets;
+    StreamRegions = realloc(StreamRegions, sizeof(struct streamregion) * NumStreamRegions);
+    for(unsigned m = 0; m < NumLightmaps; ++m)
+    {
+        StreamRegions[m] = (struct streamregion) { .begin = (const char*)Lightmaps[m].mips,
+                                                   .bytes = sizeof(LightmapUnit) * Lightmaps[m].mipoffset[Lightmaps[m].miplevels],
+                                                   .own = 0, .reached = 0, .drawn = 0, .resident = 0 };
+    }
+
+    for(unsigned k = 0; k < NumTextureSets; ++k)
+    {
+        StreamRegions[NumLightmaps + k] = (struct streamregion) { .begin = (const char*)TextureSets[k].texture,
+                                                                  .bytes = sizeof(MipTexture),
+                                                                  .own = 0, .reached = 0, .drawn = 0, .resident = 0 };
+    }
+
+    for(unsigned r = 0; r < NumStreamRegions; ++r)
+    {
+        size_t begin;
+        StreamRegions[r].own = RegionPages(&StreamRegions[r], 1, &begin);
+        AdviseRegion(&StreamRegions[r], MADV_DONTNEED);
+    }
+
+    StreamResident = 0;
+}
+
+// StreamRegion: A region is within reach in this frame, or drawn in it. Drawing a region that was not drawn in the
+// last frame was predicted if it was read ahead. That says nothing of whether its pages had come in by then.
+static void StreamRegion(struct streamregion* region, int drawn)
+{
+    if(drawn && (region->drawn == 0 || region->drawn + 1 < StreamFrame))
+    {
+        StreamPredicted += region->resident;
+        StreamUnpredicted += !region->resident;
+    }
+
+    if(!region->resident)
+    {
+        if(!drawn)
+        {
+            AdviseRegion(region, MADV_WILLNEED);
+            ++StreamReadAhead;
+        }
+        region->resident = 1;
+        StreamResident += region->own;
+    }
+
+    region->reached = StreamFrame;
+    if(drawn)
+        region->drawn = StreamFrame;
+}
+
+// StreamSector: The lightmaps of sector n and the textures of its surfaces are within reach, or drawn.
+static void StreamSector(unsigned n, int drawn)
+{
+    const struct sector* sect = &sectors[n];
+    for(const struct lightmap* map = sect->floorlightmap; map < sect->lowerlightmaps + sect->nPoints; ++map)
+    {
+        unsigned m = map - Lightmaps;
+        StreamRegion(&StreamRegions[m], drawn);
+        StreamRegion(&StreamRegions[NumLightmaps + (SurfaceTextures[m] - TextureSets)], drawn);
+    }
+}
+
+// StreamSurfaces: After a frame, read ahead around the sectors that were in view, and drop what has been out of
+// reach the longest while more than StreamingBudget bytes are resident. What is within reach stays, even over it.
+static void StreamSurfaces(void)
+{
+    if(!StreamRegions)
+        return;
+
+    ++StreamFrame;
+    unsigned* queue = malloc(sizeof(unsigned) * NumSectors);
+    unsigned char* depth = malloc(NumSectors);
+    unsigned head = 0, tail = 0;
+    memset(depth, 0xFF, NumSectors);
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        if(sectors[n].visible)
+        {
+            StreamSector(n, 1);
+            depth[n] = 0;
+            queue[tail++] = n;
+        }
+    }
+
+    // Breadth first through the portals, so that each sector is reached through its nearest visible one.
+    while(head < tail)
+    {
+        unsigned n = queue[head++];
+        if(depth[n] >= StreamLookahead)
+            continue;
+
+        for(unsigned s = 0; s < sectors[n].nPoints; ++s)
+        {
+            int neighbor = sectors[n].neighbors[s];
+            if(neighbor >= 0 && depth[neighbor] == 0xFF)
+            {
+                StreamSector(neighbor, 0);
+                depth[neighbor] = depth[n] + 1;
+                queue[tail++] = neighbor;
+            }
+        }
+    }
+
+    free(depth);
+    free(queue);
+
+    while(StreamResident > StreamingBudget)
+    {
+        struct streamregion* oldest = NULL;
+        for(unsigned r = 0; r < NumStreamRegions; ++r)
+        {
+            struct streamregion* region = &StreamRegions[r];
+            if(region->resident && region->reached != StreamFrame && (!oldest || region->reached < oldest->reached))
+                oldest = region;
+        }
+
+        if(!oldest)
+            break;
+
+        AdviseRegion(oldest, MADV_DONTNEED);
+        oldest->resident = 0;
+        StreamResident -= oldest->own;
+        ++StreamDropped;
+    }
+}
+#endif
+
+#if TextureMapping
+#define SpanFraction 22 // Span and wall coordinates are 10.22 fixed point; wrapping around 1024 texels comes for free.
+
+static unsigned SpanFixed(double value)
+{
+    return (unsigned)(long long)(value * (1 << SpanFraction));
+}
+
+/******************************************* WALL SPANS ********************************************/
+/* Texture u is not linear across a wall on screen, but u/z and 1/z are. A wall span steps both     */
+/* from column to column and takes one reciprocal per column to get u back. Down a column the      */
+/* depth is constant, so v just steps by a fixed amount per row. The upper, lower and solid wall   */
+/* paths all draw from the same wallcolumn.                                                        */
+/***************************************************************************************************/
+
+struct wallspan
+{
+    float uz, duz;                      // u/z at the next column, and its step per column
+    float iz, diz;                      // 1/z at the next column, and its step per column
+};
+
+struct wallcolumn
+{
+    int x;
+    int ya;                             // Unclipped top of the wall on this column, where v is 0
+    unsigned txtx;                      // Texture u
+    unsigned dv;                        // Texture v per row, 10.22 fixed point
+    unsigned level;                     // Mip level
+};
+
+static inline float WallReciprocal(float value)
+{
+#if FastReciprocal && (defined(__x86_64__) || defined(__i386__))
+    float r = _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss(value)));
+    return r * (2 - value * r);         // The estimate has 12 bits, one Newton step brings it to 22
+#else
+    return 1 / value;
+#endif
+}
+
+// WallSpan_Init: Wall from screen column x1 (depth tz1, texture u0) to x2 (tz2, u1), first drawn column beginx.
+static struct wallspan WallSpan_Init(int x1, int x2, int beginx, float tz1, float tz2, int u0, int u1)
+{
+    float iz1 = 1 / tz1, iz2 = 1 / tz2;
+    float duz = (u1 * iz2 - u0 * iz1) / (x2 - x1);
+    float diz = (iz2 - iz1) / (x2 - x1);
+    return (struct wallspan) { u0 * iz1 + (beginx - x1) * duz, duz, iz1 + (beginx - x1) * diz, diz };
+}
+
+// WallSpan_Next: Texture coordinates of column x, whose wall runs from row ya to yb. Steps to column x+1.
+static struct wallcolumn WallSpan_Next(struct wallspan* span, int x, int ya, int yb)
+{
+    float z = WallReciprocal(span->iz);
+    float u = span->uz * z;
+    float dudx = (span->duz - u * span->diz) * z;  // d(uz/iz)/dx: texels per pixel across the wall
+    float dvdy = 1023 * WallReciprocal(max(yb - ya, 1));
+
+    span->uz += span->duz;
+    span->iz += span->diz;
+
+    return (struct wallcolumn) { x, ya, clamp((int)u, 0, 1023), dvdy * (1 << SpanFraction), MipLevel(max(fabsf(dudx), dvdy)) };
+}
+
+// vline2: Draw rows y1..y2 of a textured wall column with texture t and lightmap map.
+static void vline2(const struct wallcolumn* column, int y1, int y2, const struct TextureSet* t, const struct lightmap* map,
+                   struct surfacememo* memo)
+{
+    int *pix = (int*)surface->pixels;
+    y1 = clamp(y1, 0, H-1);
+    y2 = clamp(y2, 0, H-1);
+    pix += y1 * W2 + column->x;
+
+    unsigned txtx = column->txtx, level = column->level;
+    unsigned v = (y1 - column->ya) * column->dv, dv = column->dv;
+
+#if LightMapping && SurfaceCache
+    const struct surfaceblock* block = y1 <= y2 ? GetSurfaceBlock(memo, t, map, level, NULL, NULL) : NULL;
+    if(block)
+    {
+        const int* lit = block->texels + TexelIndexLevel(level, (txtx % 1024) >> level, 0);
+        for(int y = y1; y <= y2; ++y)
+        {
+            unsigned txty = v >> SpanFraction;
+            v += dv;
+            *pix = lit[TexelIndexLevel(level, 0, (txty % 1024) >> level)];
+            pix += W2;
+        }
+
+        return;
+    }
+#else
+    (void)memo;
+#endif
+
+#if LightMapping
+    // Lightmap row and column in 16.16 fixed point; v is the texture v, which starts at the ceiling.
+    unsigned llevel = min(MipLevel((1 << level) * max(map->scale_u, map->scale_v)), map->miplevels - 1);
+    unsigned lu = clamp((int)((txtx - map->origin_u) * map->scale_u), 0, (int)map->width - 1);
+    int lv = (int)(((float)v / (1 << SpanFraction) - map->origin_v) * map->scale_v * 65536);
+    int dlv = (int)((float)dv / (1 << SpanFraction) * map->scale_v * 65536);
+
+    // Gather the column's texels, light them in one go, then write them out.
+    int texture[H], light[H], lit[H];
+    for(int y = y1; y <= y2; ++y)
+    {
+        unsigned txty = v >> SpanFraction;
+        v += dv;
+        texture[y - y1] = MipTexel(t->texture, level, txtx % 1024, txty % 1024);
+        light[y - y1] = LightmapTexel(map, llevel, lu, clamp(lv >> 16, 0, (int)map->height - 1));
+        lv += dlv;
+    }
+
+    if(y1 <= y2)
+        ApplyLightRow(lit, texture, light, y2 - y1 + 1);
+
+    for(int y = y1; y <= y2; ++y)
+    {
+        *pix = lit[y - y1];
+        pix += W2;
+    }
+#else
+    (void)map;
+    for(int y = y1; y <= y2; ++y)
+    {
+        unsigned txty = v >> SpanFraction;
+        v += dv;
+        *pix = MipTexel(t->texture, level, txtx % 1024, txty % 1024);
+        pix += W2;
+    }
+#endif
+}
+#endif
+
+#if TextureMapping
+// Visplane: the floor or ceiling columns uncovered during one sector visit. Every pixel on a screen
+// row of a flat plane has the same depth, so they are drawn afterwards as horizontal spans.
+struct visplane
+{
+    float height;                       // Plane height relative to the player's eye
+    const struct TextureSet* texture;
+#if LightMapping
+    const struct lightmap* lightmap;
+    struct vec2d bounding_min;          // Sector bounding box, the extent of the surface cache block
+    struct vec2d bounding_max;
+#endif
+    struct surfacememo memo;
+    short top[W];
+    short bottom[W];
+};
+
+// DrawSpan: Draw row y from x1 to x2 of a plane, stepping texture and lightmap coordinates with adds.
+static void DrawSpan(struct visplane* plane, int y, int x1, int x2)
+{
+    float pcos = player.angleCos;
+    float psin = player.angleSin;
+
+    // Same projection as CeilingFloorScreenCoordinatesToMapCoordinates, evaluated once per span.
+    float mapz = plane->height * H * vfov / ((H/2 - y) - player.yaw * H * vfov);
+    float relx = mapz * (W/2 - x1) / (W*hfov);
+    float mapx = mapz * pcos + relx * psin + player.where.x;
+    float mapy = mapz * psin - relx * pcos + player.where.y;
+
+    // One column to the right moves relx by -mapz/(W*hfov).
+    float step  = mapz / (W*hfov);
+    float stepx = -step * psin;
+    float stepy =  step * pcos;
+
+    unsigned u  = SpanFixed(mapx * 256.0), du = SpanFixed(stepx * 256.0);
+    unsigned v  = SpanFixed(mapy * 256.0), dv = SpanFixed(stepy * 256.0);
+#if LightMapping
+    // Lightmap coordinates in 16.16 fixed point, clamped because rounding may step just outside the sector.
+    const struct lightmap* lightmap = plane->lightmap;
+    float lscalex = lightmap->scale_u;
+    float lscaley = lightmap->scale_v;
+    int lu = (int)((mapx - lightmap->origin_u) * lscalex * 65536), dlu = (int)(stepx * lscalex * 65536);
+    int lv = (int)((mapy - lightmap->origin_v) * lscaley * 65536), dlv = (int)(stepy * lscaley * 65536);
+#endif
+
+    // Map distance covered by one pixel: along the row, or from row to row as the depth changes.
+    float footprint = max(step, fabs(mapz / ((H/2 - y) - player.yaw * H * vfov)));
+    unsigned level = MipLevel(footprint * 256);
+#if LightMapping
+    unsigned llevel = min(MipLevel(footprint * max(lscalex, lscaley)), lightmap->miplevels - 1);
+#endif
+
+    const struct TextureSet* txt = plane->texture;
+    int *pix = (int*)surface->pixels + y * W2 + x1;
+
+#if LightMapping && SurfaceCache
+    const struct surfaceblock* block = GetSurfaceBlock(&plane->memo, txt, lightmap, level, &plane->bounding_min, &plane->bounding_max);
+    if(block)
+    {
+        // Block coordinates in 16.16 fixed point; clamped because rounding may step just outside the sector.
+        float scale = 256.f / (1 << level);
+        int s  = (int)((mapx * scale - block->origin_a) * 65536), ds = (int)(stepx * scale * 65536);
+        int t  = (int)((mapy * scale - block->origin_b) * 65536), dt = (int)(stepy * scale * 65536);
+        for(int x = x1; x <= x2; ++x)
+        {
+            *pix++ = block->texels[clamp(s >> 16, 0, block->width - 1) * block->height + clamp(t >> 16, 0, block->height - 1)];
+            s += ds;
+            t += dt;
+        }
+
+        return;
+    }
+#endif
+
+#if LightMapping
+    // Spans are contiguous in the framebuffer: gather the texels, then light them straight into it.
+    int texture[W], light[W];
+    for(int x = x1; x <= x2; ++x)
+    {
+        texture[x - x1] = MipTexel(txt->texture, level, u >> SpanFraction, v >> SpanFraction);
+        light[x - x1] = LightmapTexel(lightmap, llevel, clamp(lu >> 16, 0, (int)lightmap->width - 1),
+                                      clamp(lv >> 16, 0, (int)lightmap->height - 1));
+        lu += dlu;
+        lv += dlv;
+        u += du;
+        v += dv;
+    }
+
+    if(x1 <= x2)
+        ApplyLightRow(pix, texture, light, x2 - x1 + 1);
+#else
+    for(int x = x1; x <= x2; ++x)
+    {
+        unsigned txtx = u >> SpanFraction;
+        unsigned txtz = v >> SpanFraction;
+        *pix++ = MipTexel(txt->texture, level, txtz, txtx);
+        u += du;
+        v += dv;
+    }
+#endif
+}
+
+static void ClearPlane(struct visplane* plane, int sx1, int sx2)
+{
+    for(int x = sx1; x <= sx2; ++x)
+    {
+        plane->top[x] = H;
+        plane->bottom[x] = -1;
+    }
+}
+
+// AddPlaneColumn: Mark rows y1..y2 of column x as belonging to this plane.
+static void AddPlaneColumn(struct visplane* plane, int x, int y1, int y2)
+{
+    if(y1 > y2)
+        return;
+
+    // Where two walls meet, a column gets visited twice. Keep it simple and draw the second part right away.
+    if(plane->top[x] <= plane->bottom[x])
+    {
+        for(int y = y1; y <= y2; ++y)
+        {
+            DrawSpan(plane, y, x, x);
+        }
+
+        return;
+    }
+
+    plane->top[x] = y1;
+    plane->bottom[x] = y2;
 }
 
-#if TextureMapping
-static void vline2(int x, int y1, int y2, struct Scaler ty, unsigned txtx, const struct TextureSet* t)
+// DrawPlane: Turn the collected columns into horizontal spans (like Doom's R_MakeSpans) and draw them.
+static void DrawPlane(struct visplane* plane, int sx1, int sx2)
 {
-    int *pix = (int*)surface->pixels;
-    y1 = clamp(y1, 0, H-1);
-    y2 = clamp(y2, 0, H-1);
-    pix += y1 * W2 + x;
+    short spanstart[H];
 
-    for(int y = y1; y <= y2; ++y)
+    int t1 = H, b1 = -1;
+    for(int x = sx1; x <= sx2 + 1; ++x)
     {
-        unsigned txty = Scaler_Next(&ty);
-#if LightMapping
-        *pix = ApplyLight(t->texture[txtx % 1024][txty % 1024], t->lightmap[txtx % 1024][txty % 1024]);
-#else
-        *pix = t->texture[txtx % 1024][txty % 1024];
-#endif
-        pix += W2;
+        int t2 = x <= sx2 ? plane->top[x] : H;
+        int b2 = x <= sx2 ? plane->bottom[x] : -1;
+
+        // Close the spans of rows that the previous column had and this one doesn't
+        for(; t1 < t2 && t1 <= b1; ++t1)
+        {
+            DrawSpan(plane, t1, spanstart[t1], x-1);
+        }
+
+        for(; b1 > b2 && b1 >= t1; --b1)
+        {
+            DrawSpan(plane, b1, spanstart[b1], x-1);
+        }
+
+        // Open spans for rows that start at this column
+        for(; t2 < t1 && t2 <= b2; ++t2)
+        {
+            spanstart[t2] = x;
+        }
+
+        for(; b2 > b1 && b2 >= t2; --b2)
+        {
+            spanstart[b2] = x;
+        }
+
+        t1 = x <= sx2 ? plane->top[x] : H;
+        b1 = x <= sx2 ? plane->bottom[x] : -1;
     }
 }
 #endif
 
-static void DrawScreen()
+// Portal traversal counters, totals over all frames
+static unsigned long PortalsTraversed = 0, PortalsMerged = 0, PortalsSkipped = 0;
+
+struct stripitem
+{
+    short sectorno;
+    short sx1;
+    short sx2;
+};
+
+// Work list of sector windows of each strip. It is kept from frame to frame, so it only grows.
+static struct stripqueue
+{
+    struct stripitem* items;
+    unsigned capacity;
+} StripQueues[(W + StripWidth - 1) / StripWidth];
+
+// GrowStripQueue: Make room for twice as many items, or MaxQueue to start with. Returns 0 if there is no memory.
+static int GrowStripQueue(struct stripqueue* list)
 {
-    struct item
+    unsigned capacity = list->capacity ? list->capacity * 2 : MaxQueue;
+    struct stripitem* items = realloc(list->items, capacity * sizeof(*items));
+    if(!items)
     {
-        short sectorno;
-        short sx1;
-        short sx2;
-    };
+        perror("realloc");
+        return 0;
+    }
+
+    list->items = items;
+    list->capacity = capacity;
+    return 1;
+}
 
-    struct item queue[MaxQueue];
-    struct item *head = queue;
-    struct item *tail = queue;
+// DrawScreenStrip: Render columns sx1..sx2 of the screen. Each strip runs its own portal traversal
+// from the player's sector, so strips can be rendered in parallel without sharing any state.
+static void DrawScreenStrip(int sx1, int sx2)
+{
+    // Work list of sector windows. Items are never removed, so indices into it stay valid;
+    // pending[] points at the unvisited item of each sector, which later portals merge into.
+    struct stripqueue* list = &StripQueues[sx1 / StripWidth];
+    if(list->capacity == 0 && !GrowStripQueue(list))
+        return;
+
+    struct stripitem *queue = list->items;
+    unsigned head = 0;
+    unsigned tail = 0;
 
     short ytop[W] = {0};
     short ybottom[W];
     short renderedSectors[NumSectors];
+    int pending[NumSectors];
 
     for(unsigned x=0; x<W; ++x)
     {
@@ -1899,40 +4960,45 @@ static void DrawScreen()
     for(unsigned n=0; n<NumSectors; ++n)
     {
         renderedSectors[n] = 0;
+        pending[n] = -1;
     }
 
-#if VisibilityTracking
-    for(unsigned n = 0; n < NumSectors; ++n)
-    {
-        sectors[n].visible = 0;
-    }
+    // A column is closed once its window is empty; traversal stops when the whole strip is.
+    #define ColumnClosed(x) (ytop[x] > ybottom[x])
+    int opencolumns = sx2 - sx1 + 1;
+    unsigned long traversed = 0, merged = 0, skipped = 0;
 
-    memset(VisibleFloors, 0, sizeof(VisibleFloors));
-    memset(VisibleCeils, 0, sizeof(VisibleCeils));
-    NumVisibleSectors = 0;
+#if VisibilityTracking
+    unsigned visibleSectors = 0;
 #endif
 
-    *head = (struct item) { player.sector, 0, W-1 };
+    queue[head++] = (struct stripitem) { player.sector, sx1, sx2 };
 
-    if(++head == queue+MaxQueue)
+    while(head != tail && opencolumns > 0)
     {
-        head = queue;
-    }
+        // pick a sector and slice from queue to draw
+        if(pending[queue[tail].sectorno] == (int)tail)
+        {
+            pending[queue[tail].sectorno] = -1;
+        }
 
-    SDL_LockSurface(surface);
+        struct stripitem now = queue[tail++];
 
-    while(head != tail)
-    {
-        // pick a sector and slice from queue to draw
-        const struct item now = *tail;
+        // Columns closed since the portal was queued need no drawing.
+        while(now.sx1 <= now.sx2 && ColumnClosed(now.sx1)) ++now.sx1;
+        while(now.sx1 <= now.sx2 && ColumnClosed(now.sx2)) --now.sx2;
 
-        if(++tail == queue+MaxQueue)
+        if(now.sx1 > now.sx2 || renderedSectors[now.sectorno] >= MaxSectorVisits)
         {
-            tail = queue;
+            ++skipped;
+            continue;
         }
 
-        if(renderedSectors[now.sectorno] & 0x21) continue; // Odd = still rendering, 0x20 = give up
         ++renderedSectors[now.sectorno];
+        ++traversed;
+
+        unsigned char covered[W]; // 1 = solid wall, 2 = portal, clipped wall or end column of a wall
+        memset(covered + now.sx1, 0, now.sx2 - now.sx1 + 1);
 
 #if VisibilityTracking
     sectors[now.sectorno].visible = 1;
@@ -1940,10 +5006,22 @@ static void DrawScreen()
 
         const struct sector* const sect = &sectors[now.sectorno];
 
-#if LightMapping
-        struct vec2d bounding_min = { 1e9f, 1e9f };
-        struct vec2d bounding_max = { -1e9f, -1e9f };
-        GetSectorBoundingBox(now.sectorno, &bounding_min, &bounding_max);
+#if TextureMapping
+        struct visplane ceilplane, floorplane;
+        ceilplane.memo     = floorplane.memo = (struct surfacememo) { NULL, 0, NULL };
+        ceilplane.height   = sect->ceil - player.where.z;
+        ceilplane.texture  = sect->ceiltexture;
+        floorplane.height  = sect->floor - player.where.z;
+        floorplane.texture = sect->floortexture;
+        ClearPlane(&ceilplane, now.sx1, now.sx2);
+        ClearPlane(&floorplane, now.sx1, now.sx2);
+#endif
+
+#if TextureMapping && LightMapping
+        ceilplane.bounding_min   = floorplane.bounding_min   = Geometry.bounding_min[now.sectorno];
+        ceilplane.bounding_max   = floorplane.bounding_max   = Geometry.bounding_max[now.sectorno];
+        ceilplane.lightmap       = sect->ceillightmap;
+        floorplane.lightmap      = sect->floorlightmap;
 #endif
 
         // Render each wall of this sector that is facing towards player.
@@ -1972,7 +5050,8 @@ static void DrawScreen()
 #endif            
 
             // If it's partially behaind the player, clip it against player's view frustrum
-            if(tz1 <= 0 || tz2 <= 0)
+            int clipped = tz1 <= 0 || tz2 <= 0;
+            if(clipped)
             {
                 float nearz = 1e-4f;
                 float farz = 5;
@@ -2081,12 +5160,13 @@ static void DrawScreen()
             struct Scaler yb_int    = Scaler_Init(x1, beginx, x2, y1b, y2b);
             struct Scaler nya_int   = Scaler_Init(x1, beginx, x2, ny1a, ny2a);
             struct Scaler nyb_int   = Scaler_Init(x1, beginx, x2, ny1b, ny2b);
+#if TextureMapping
+            struct wallspan span = WallSpan_Init(x1, x2, beginx, tz1, tz2, u0, u1);
+            struct surfacememo uppermemo = { NULL, 0, NULL }, lowermemo = { NULL, 0, NULL };
+#endif
 ;
             for(int x = beginx; x <= endx; ++x)
             {
-#if TextureMapping
-                int txtx = (u0*((x2-x)*tz2) + u1*((x-x1)*tz1)) / ((x2-x)*tz2 + (x-x1)*tz1);
-#endif                
 #if DepthShading && !TextureMapping
                 // Calculate the Z coordinate for this point (Only used for lighting)
                 int z = Scaler_Next(&z_int);//((x - x1) * (tz2-tz1) / (x2-x1) + tz1) * 8;
@@ -2094,6 +5174,19 @@ static void DrawScreen()
                 // Acquire the Y coordinates for our ceiling and floor for this X coordinate. Clamp them.
                 int ya = Scaler_Next(&ya_int); //(x-x1) * (y2a - y1a) / (x2-x1) + y1a;
                 int yb = Scaler_Next(&yb_int); //(x-x1) * (y2b - y1b) / (x2-x1) + y1b;
+#if TextureMapping
+                struct wallcolumn column = WallSpan_Next(&span, x, ya, yb);
+#endif
+                if(ColumnClosed(x))
+                {
+                    if(neighbor >= 0)
+                    {
+                        Scaler_Next(&nya_int);
+                        Scaler_Next(&nyb_int);
+                    }
+                    continue;
+                }
+
                 int cya = clamp(ya, ytop[x], ybottom[x]); // top
                 int cyb = clamp(yb, ytop[x], ybottom[x]); // bottom
 
@@ -2129,31 +5222,9 @@ static void DrawScreen()
 
 
 #if TextureMapping
-                for(int y = ytop[x]; y <= ybottom[x]; ++y)
-                {
-                    if(y >= cya && y <= cyb)
-                    {
-                        y = cyb;
-                        continue;
-                    }
-
-                    float hei = y < cya ? yceil : yfloor;
-                    float mapx, mapz;
-
-                    CeilingFloorScreenCoordinatesToMapCoordinates(hei, x, y, mapx, mapz);
-                    unsigned txtx = (mapx * 256);
-                    unsigned txtz = (mapz * 256);
-                    const struct TextureSet* txt = y < cya ? sect->ceiltexture : sect->floortexture;
-
-#if LightMapping
-                    unsigned lu = ((unsigned)((mapx - bounding_min.x) * 1024 / (bounding_max.x - bounding_min.x))) % 1024;
-                    unsigned lv = ((unsigned)((mapz - bounding_min.y) * 1024 / (bounding_max.y - bounding_min.y))) % 1024;
-                    int pel = ApplyLight(txt->texture[txtx % 1024][txtz % 1024], txt->lightmap[lu][lv]);
-#else
-                    int pel = txt->texture[txtz % 1024][txtx % 1024];
-#endif
-                    ((int*)surface->pixels)[y*W2+x] = pel;
-                }
+                // Ceiling above and floor below the wall are drawn as spans once the whole sector is done.
+                AddPlaneColumn(&ceilplane, x, ytop[x], cya-1);
+                AddPlaneColumn(&floorplane, x, max(cya, cyb+1), ybottom[x]);
 #else
                 // Render ceiling: everything above this sector's ceiling height
                 vline(x, ytop[x], cya-1, 0x111111, 0x222222, 0x111111);
@@ -2163,8 +5234,9 @@ static void DrawScreen()
 #endif
 
 #if VisibilityTracking
+                if(visibleSectors < MaxVisibleSectors)
                 {
-                    unsigned n = NumVisibleSectors;
+                    unsigned n = visibleSectors;
                     if(ybottom[x] >= (cyb+1))
                     {
                         float FloorXbegin, FloorZbegin, FloorXend, FloorZend;
@@ -2196,7 +5268,7 @@ static void DrawScreen()
 
                     // If our ceiling is higher than ther ceiling, render upper wall
 #if TextureMapping
-                    vline2(x, cya, cnya-1, (struct Scaler)Scaler_Init(ya,cya,yb,0,1023), txtx, &sect->uppertextures[s]);
+                    vline2(&column, cya, cnya-1, sect->uppertextures[s], &sect->upperlightmaps[s], &uppermemo);
 #else
     #if DepthShading
                     unsigned r1 = 0x010101 * (255 - z);
@@ -2211,17 +5283,22 @@ static void DrawScreen()
 
                     // If our floor is lower than ther floor, render bottom wall
 #if TextureMapping
-                    vline2(x, cnyb+1, cyb,  (struct Scaler)Scaler_Init(ya,cnyb+1,yb,0,1023), txtx, &sect->lowertextures[s]);
+                    vline2(&column, cnyb+1, cyb, sect->lowertextures[s], &sect->lowerlightmaps[s], &lowermemo);
 #else
                     vline(x, cnyb+1, cyb, 0, x == x1 || x == x2 ? 0 : r2, 0); // Between their and our floor
 #endif
                     ybottom[x] = clamp(min(cyb, cnyb), 0, ybottom[x]); // Shrink the remaining window above these floor
+                    covered[x] |= 2;
+                    if(ColumnClosed(x))
+                    {
+                        --opencolumns;
+                    }
                 }
                 else
                 {
                     // NO NEIGHBOR!!!! Render wall from top to bottom
 #if TextureMapping
-                    vline2(x, cya, cyb, (struct Scaler)Scaler_Init(ya,cya,yb,0,1023), txtx, &sect->uppertextures[s]);
+                    vline2(&column, cya, cyb, sect->uppertextures[s], &sect->upperlightmaps[s], &uppermemo);
 #else
     #if DepthShading
                     unsigned r = 0x010101 * (255-z);
@@ -2230,40 +5307,400 @@ static void DrawScreen()
     #endif
                     vline(x, cya, cyb, 0, x==x1 || x == x2 ? 0 : r, 0);
 #endif                    
+                    // Nothing can be seen past a solid wall, see below.
+                    covered[x] |= clipped || x == x1 || x == x2 ? 2 : 1;
                 }
             } // for ends
 
             // Shedule the neighboring sector for rendering within the window formed by this wall
-            if(neighbor >= 0 && endx >= beginx && (head+MaxQueue+1-tail)%MaxQueue)
+            if(neighbor >= 0 && endx >= beginx)
             {
-                *head = (struct item) { neighbor, beginx, endx };
-                if(++head == queue+MaxQueue)
+                while(beginx <= endx && ColumnClosed(beginx)) ++beginx;
+                while(beginx <= endx && ColumnClosed(endx)) --endx;
+
+                struct stripitem* other = pending[neighbor] >= 0 ? &queue[pending[neighbor]] : NULL;
+                if(beginx > endx)
+                {
+                    ++skipped; // Closed portal, e.g. a door or a step as high as the window
+                }
+                else if(other && beginx <= other->sx2 + 1 && endx >= other->sx1 - 1)
+                {
+                    // Touching windows of one sector are drawn in one visit.
+                    other->sx1 = min(other->sx1, beginx);
+                    other->sx2 = max(other->sx2, endx);
+                    ++merged;
+                }
+                else if(head == list->capacity && !GrowStripQueue(list))
+                {
+                    ++skipped; // No room left in the work list
+                }
+                else
                 {
-                    head = queue;
+                    queue = list->items;
+                    pending[neighbor] = head;
+                    queue[head++] = (struct stripitem) { neighbor, beginx, endx };
                 }
             }
         }  // for ends
 
-        ++renderedSectors[now.sectorno];
+#if TextureMapping
+        DrawPlane(&ceilplane, now.sx1, now.sx2);
+        DrawPlane(&floorplane, now.sx1, now.sx2);
+#endif
+
+        // Close the columns a solid wall covered. Concave sectors overdraw their own walls, walls clipped
+        // against the view frustrum only roughly cover their columns and the end columns of a wall are
+        // shared with the next one, so all of those stay open.
+        for(int x = now.sx1; x <= now.sx2; ++x)
+        {
+            if(covered[x] == 1)
+            {
+                ytop[x] = H;
+                ybottom[x] = -1;
+                --opencolumns;
+            }
+        }
+
 #if VisibilityTracking
-        NumVisibleSectors += 1;
+        visibleSectors += 1;
 #endif
     } 
 
-    SDL_UnlockSurface(surface);
+    #undef ColumnClosed
+    skipped += head - tail; // Left over once the whole strip was closed
+
+    #pragma omp atomic
+    PortalsTraversed += traversed;
+    #pragma omp atomic
+    PortalsMerged += merged;
+    #pragma omp atomic
+    PortalsSkipped += skipped;
+
+#if VisibilityTracking
+    // Strips fill the visibility cones of their own columns; the map draws up to the longest list.
+    #pragma omp critical(visibility)
+    NumVisibleSectors = max(NumVisibleSectors, min(visibleSectors, MaxVisibleSectors));
+#endif
+}
+
+static void DrawScreen()
+{
+#if VisibilityTracking
+    for(unsigned n = 0; n < NumSectors; ++n)
+    {
+        sectors[n].visible = 0;
+    }
+
+    memset(VisibleFloors, 0, sizeof(VisibleFloors));
+    memset(VisibleCeils, 0, sizeof(VisibleCeils));
+    NumVisibleSectors = 0;
+#endif
+
+#if TextureMapping && LightMapping && SurfaceCache
+    ++SurfaceCacheFrame;
+#endif
+
+    LockSurface(surface);
+
+    // Idle threads pick up the next unrendered strip, so uneven strips balance themselves out.
+    // The output is identical to rendering the whole screen as one strip.
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int strip = 0; strip < (W + StripWidth - 1) / StripWidth; ++strip)
+    {
+        DrawScreenStrip(strip * StripWidth, min((strip + 1) * StripWidth, W) - 1);
+    }
+
+    UnlockSurface(surface);
+
+#if TextureMapping && LightMapping && VisibilityTracking && SurfaceStreaming
+    StreamSurfaces();
+#endif
+}
+
+#if Headless
+/******************************************** BENCHMARK ********************************************/
+/* Replays a camera path through the map, rendering into the in-memory framebuffer, and reports    */
+/* frame time statistics. Camera path lines: camera <x> <y> <z> <angle> <yaw> <sector>             */
+/***************************************************************************************************/
+
+static struct camerakey
+{
+    struct vec3d where;
+    float angle;
+    float yaw;
+    unsigned char sector;
+} *camerakeys = NULL;
+
+static unsigned NumCameraKeys = 0;
+
+static void LoadCameraPath(const char* filename)
+{
+    FILE *fp = fopen(filename, "rt");
+
+    if (!fp)
+    {
+        perror(filename);
+        exit(1);
+    }
+
+    char buf[256];
+    char word[256];
+    char *ptr;
+    int n;
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+        if (sscanf(ptr = buf, "%32s%n", word, &n) != 1 || strcmp(word, "camera") != 0)
+            continue;
+
+        struct camerakey key;
+        float number;
+        if (sscanf(ptr += n, "%f %f %f %f %f %f", &key.where.x, &key.where.y, &key.where.z,
+                                                  &key.angle, &key.yaw, &number) != 6)
+        {
+            fprintf(stderr, "%s: Malformed camera line: %s", filename, buf);
+            continue;
+        }
+
+        if (number < 0 || number >= NumSectors)
+        {
+            fprintf(stderr, "%s: Invalid sector %g, only have %u\n", filename, number, NumSectors);
+            continue;
+        }
+
+        key.sector = (int)number;
+        camerakeys = realloc(camerakeys, ++NumCameraKeys * sizeof(*camerakeys));
+        camerakeys[NumCameraKeys - 1] = key;
+    }
+
+    fclose(fp);
+}
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int CompareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void DumpFrame(const char* prefix, unsigned frame)
+{
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s%04u.ppm", prefix, frame);
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        perror(filename);
+        return;
+    }
+
+    fprintf(fp, "P6\n%d %d\n255\n", W2, H);
+    const int *pix = (const int*) surface->pixels;
+    for (unsigned p = 0; p < W2*H; ++p)
+    {
+        fputc((pix[p] >> 16) & 0xFF, fp);
+        fputc((pix[p] >>  8) & 0xFF, fp);
+        fputc((pix[p] >>  0) & 0xFF, fp);
+    }
+
+    fclose(fp);
 }
 
+int main(int argc, char** argv)
+{
+    const char* pathfile = "camera.txt";
+    const char* dumpprefix = NULL;
+    unsigned passes = 5;
+    unsigned warmup = 1;
+    const char* kernel = NULL;
+    int rebuild = 0;
+    int bake = 0;
+    int resume = 0;
+    int map = 0;
+
+    for (int a = 1; a < argc; ++a)
+    {
+        if (strcmp(argv[a], "--path") == 0 && a+1 < argc)        pathfile = argv[++a];
+        else if (strcmp(argv[a], "--passes") == 0 && a+1 < argc) passes = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--warmup") == 0 && a+1 < argc) warmup = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--dump") == 0 && a+1 < argc)   dumpprefix = argv[++a];
+        else if (strcmp(argv[a], "--map") == 0)                  map = 1;
+        else if (strcmp(argv[a], "--rebuild") == 0)              rebuild = 1;
+        else if (strcmp(argv[a], "--bake") == 0)                 bake = 1;
+        else if (strcmp(argv[a], "--resume") == 0)               resume = 1;
+        else if (strcmp(argv[a], "--kernel") == 0 && a+1 < argc) kernel = argv[++a];
+        else
+        {
+            fprintf(stderr, "Usage: %s [--path camera.txt] [--passes N] [--warmup N] [--dump prefix] [--map] [--rebuild] [--bake] [--resume]"
+                            " [--kernel scalar|sse2|avx2]\n", argv[0]);
+            return 1;
+        }
+    }
+
+#if TextureMapping && LightMapping
+    if (!SelectKernels(kernel))
+    {
+        fprintf(stderr, "Lighting kernel %s is not available on this CPU\n", kernel);
+        return 1;
+    }
+#else
+    (void)kernel;
+#endif
+
+    LoadData();
+    VerifyMap();
+    CompileGeometry();
+#if TextureMapping
+    int textures_initialized = LoadTexture();
+    #if LightMapping
+        // Baking takes hours, so a headless run only does it when explicitly asked to: --rebuild bakes
+        // everything, --bake only what has changed, and --resume goes on with an interrupted bake.
+        if(rebuild || bake || resume)
+            BuildLightmaps(rebuild, resume);
+        else if(textures_initialized)
+            fprintf(stderr, "Note: Lightmaps have not been baked, frames will be dark. Use --rebuild to bake them.\n");
+        else if(BakeJournal->round > maxrounds)
+            fprintf(stderr, "Note: A bake was interrupted after round %u. Use --resume to go on with it.\n", BakeJournal->last);
+        else if(BakeJournal->round != 0)
+            fprintf(stderr, "Note: A bake was interrupted in round %u. Use --resume to go on with it.\n", BakeJournal->round);
+        else
+        {
+            unsigned dirty = CountDirtySectors();
+            if(dirty > 0)
+                fprintf(stderr, "Note: Lightmaps of %u sectors are out of date. Use --bake to bake them again.\n", dirty);
+        }
+    #endif
+    #if LightMapping && VisibilityTracking && SurfaceStreaming
+        InitStreaming();
+    #endif
+#endif
+
+    LoadCameraPath(pathfile);
+    if (NumCameraKeys == 0 || passes == 0)
+    {
+        fprintf(stderr, "%s: No camera keyframes to replay\n", pathfile);
+        return 1;
+    }
+
+    static int pixels[W2*H];
+    static Framebuffer framebuffer = { W2, H, pixels };
+    surface = &framebuffer;
+
+    unsigned numframes = NumCameraKeys * passes;
+    double *frametimes = malloc(numframes * sizeof(*frametimes));
+    unsigned long long checksum = 14695981039346656037ull;
+
+    for (unsigned pass = 0; pass < warmup + passes; ++pass)
+    {
+        for (unsigned k = 0; k < NumCameraKeys; ++k)
+        {
+            const struct camerakey* key = &camerakeys[k];
+            player.where    = key->where;
+            player.velocity = (struct vec3d){ 0, 0, 0 };
+            player.angle    = key->angle;
+            player.angleSin = sinf(key->angle);
+            player.angleCos = cosf(key->angle);
+            player.yaw      = key->yaw;
+            player.sector   = key->sector;
+
+            memset(pixels, 0, sizeof(pixels));
+
+            double begin = Now();
+            DrawScreen();
+            if (map)
+                DrawMap();
+            double end = Now();
+
+            if (pass < warmup)
+                continue;
+
+            frametimes[(pass - warmup) * NumCameraKeys + k] = end - begin;
+
+            // The first measured pass doubles as the reference output for regression checks.
+            if (pass == warmup)
+            {
+                const unsigned char* bytes = (const unsigned char*) pixels;
+                for (unsigned b = 0; b < sizeof(pixels); ++b)
+                {
+                    checksum = (checksum ^ bytes[b]) * 1099511628211ull;
+                }
+
+                if (dumpprefix)
+                    DumpFrame(dumpprefix, k);
+            }
+        }
+    }
+
+    double total = 0;
+    for (unsigned f = 0; f < numframes; ++f)
+    {
+        total += frametimes[f];
+    }
+
+    qsort(frametimes, numframes, sizeof(*frametimes), CompareDoubles);
+
+    unsigned p99 = (numframes * 99 + 99) / 100 - 1;
+    double pixels_per_frame = (double)(map ? W2 : W) * H;
+
+    printf("%u frames (%u keyframes x %u passes, %u warmup)\n", numframes, NumCameraKeys, passes, warmup);
+    printf("frame time: min %.3f ms, median %.3f ms, p99 %.3f ms, mean %.3f ms\n",
+           frametimes[0] * 1e3, frametimes[numframes / 2] * 1e3, frametimes[p99] * 1e3, total / numframes * 1e3);
+    printf("throughput: %.1f Mpixels/s, %.1f frames/s\n", pixels_per_frame * numframes / total * 1e-6, numframes / total);
+    printf("checksum: %016llx\n", checksum);
+#if TextureMapping && LightMapping
+    printf("lighting kernel: %s\n", LightKernelName);
+#endif
+#if TextureMapping && LightMapping && SurfaceCache
+    printf("surface cache: %.1f MB in use, %lu blocks built, %lu evicted\n", SurfaceCacheUsed / 1048576.0,
+           SurfaceCacheBuilt, SurfaceCacheEvicted);
+#endif
+#if TextureMapping && LightMapping && VisibilityTracking && SurfaceStreaming
+    printf("streaming: %.1f MB resident, %lu read ahead, %lu dropped; coming into view: %lu predicted, %lu not\n",
+           StreamResident / 1048576.0, StreamReadAhead, StreamDropped, StreamPredicted, StreamUnpredicted);
+#endif
+    unsigned rendered = (warmup + passes) * NumCameraKeys;
+    printf("portals per frame: %.1f traversed, %.1f merged, %.1f skipped\n", (double)PortalsTraversed / rendered,
+           (double)PortalsMerged / rendered, (double)PortalsSkipped / rendered);
+
+    free(frametimes);
+    free(camerakeys);
+    UnloadData();
+    return 0;
+}
+#else
 static SDL_Window *window = NULL;
 
 int main(int argc, char** argv)
 {
+#if TextureMapping && LightMapping
+    SelectKernels(NULL);
+#endif
     LoadData();
     VerifyMap();
+    CompileGeometry();
 #if TextureMapping
     int textures_initialized = LoadTexture();
     #if LightMapping
-        if(textures_initialized || (argc > 1 && strcmp(argv[1], "--rebuild") == 0))
-            BuildLightmaps();
+        // Bake whatever has changed in the map since the last time, or everything with --rebuild.
+        // --resume goes on with an interrupted bake.
+        int rebuild = 0, resume = 0;
+        for(int a = 1; a < argc; ++a)
+        {
+            rebuild |= strcmp(argv[a], "--rebuild") == 0;
+            resume  |= strcmp(argv[a], "--resume") == 0;
+        }
+
+        BuildLightmaps(textures_initialized || rebuild, resume);
+    #endif
+    #if LightMapping && VisibilityTracking && SurfaceStreaming
+        InitStreaming();
     #endif
 #endif
 
@@ -2367,11 +5804,11 @@ int main(int argc, char** argv)
             for(unsigned s = 0; s < sect->nPoints; ++s)
             {
                 if(IntersectBox(px, py, px+dx, py+dy, vert[s+0].x, vert[s+0].y, vert[s+1].x,vert[s+1].y)
-                && PointSide(px+dx, py+dy, vert[s+0].x, vert[s+0].y, vert[s+1].x, vert[s+1].y) < 0)
+                && WallSide(Geometry.firstwall[player.sector] + s, px+dx, py+dy) < 0)
                 {
                     // Check where the hole is
-                    float hole_low  = sect->neighbors[s] < 0 ? 9e9 : max(sect->floor, sectors[sect->neighbors[s]].floor);
-                    float hole_high = sect->neighbors[s] < 0 ? -9e9 : min(sect->ceil, sectors[sect->neighbors[s]].ceil);
+                    float hole_low  = Geometry.hole_low[Geometry.firstwall[player.sector] + s];
+                    float hole_high = Geometry.hole_high[Geometry.firstwall[player.sector] + s];
 
                     // Check whether we're bumping into a wall
                     if(hole_high < player.where.z + HeadMargin || hole_low > player.where.z - eyeheight +KneeHeight)
@@ -2485,4 +5922,5 @@ done:
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
-}
\ No newline at end of file
+}
+#endif